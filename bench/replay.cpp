@@ -0,0 +1,219 @@
+// Headless throughput benchmark: pushes debug streams through the real
+// input framing, dispatch and window code on SDL's dummy video driver.
+#include "../main.hpp"
+#include "../terminal.hpp"
+#include "../input.hpp"
+#include "../dispatch.hpp"
+#include "../capture.hpp"
+#include "../snapshot.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Scenario {
+    std::string name;
+    std::string data;
+};
+
+static size_t peak_memory_kb() {
+    #ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(),&pmc,sizeof(pmc))) return 0;
+    return pmc.PeakWorkingSetSize/1024;
+    #else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF,&usage)) return 0;
+    return usage.ru_maxrss;
+    #endif
+}
+
+// Recorded streams are a bit awkward to ship, so the standard ones get generated
+static std::vector<Scenario> builtin_scenarios() {
+    std::vector<Scenario> list;
+    std::ostringstream s;
+
+    for (int i=0;i<20000;i++) s << "Cog0  INIT $0000_0000 $0000_0000 load, i = " << i << "\r\n";
+    list.push_back({"text",s.str()});
+    s.str("");
+
+    s << "`TERM MyTerm SIZE 40 10 TEXTSIZE 16\r\n";
+    for (int i=0;i<20000;i++) s << "`MyTerm 'Value " << i << " = ' " << (48+i%10) << " 13\r\n";
+    list.push_back({"term",s.str()});
+    s.str("");
+
+    s << "`TERM MyTerm SIZE 9 1 TEXTSIZE 40 UPDATE\r\n";
+    for (int i=0;i<20000;i++) {
+        s << "`MyTerm 1 'IDK? = x' " << (48+i%10) << "\r\n";
+        if (i&1) s << "`MyTerm UPDATE\r\n";
+    }
+    list.push_back({"update",s.str()});
+    s.str("");
+
+    for (int i=0;i<2000;i++) {
+        s << "`TERM MyTerm SIZE 9 1 TEXTSIZE 40 color " << (i&1 ? "blue" : "red") << "\r\n";
+        s << "`MyTerm 1 'IDK? = x' " << (97+i%26) << "\r\n";
+    }
+    list.push_back({"reinit",s.str()});
+    s.str("");
+
+    s << "`TERM MyTerm SIZE 20 4\r\n";
+    for (int i=0;i<2000;i++) {
+        s << "`MyTerm 'line " << i << "' 13\r\n";
+        if (i%200 == 199) s << "`MyTerm SAVE 'bench_save'\r\n";
+    }
+    list.push_back({"save",s.str()});
+    s.str("");
+
+    for (int w=0;w<8;w++) s << "`TERM Win" << w << " SIZE 32 8\r\n";
+    for (int i=0;i<20000;i++) {
+        s << "`Win" << i%8 << " 'tick " << i << "' 13\r\n";
+        if (i%4 == 0) s << "plain text in between " << i << "\r\n";
+    }
+    list.push_back({"mixed",s.str()});
+    s.str("");
+
+    // Lots of windows changing every frame, for the parallel rendering
+    for (int w=0;w<24;w++) s << "`TERM Par" << w << " SIZE 40 12 TEXTSIZE 14\r\n";
+    for (int i=0;i<24000;i++) s << "`Par" << i%24 << " 'row " << i << " of lots of parallel output' 13\r\n";
+    list.push_back({"parallel",s.str()});
+    s.str("");
+
+    // Status display poking a few scattered cells, far apart
+    s << "`TERM Stat SIZE 80 25\r\n";
+    for (int i=0;i<20000;i++) {
+        s << "`Stat 2 " << i%5 << " 3 " << i%3 << " '" << char('a'+i%26) << "'";
+        s << " 2 " << 75+i%5 << " 3 " << 22+i%3 << " '" << char('A'+i%26) << "'\r\n";
+    }
+    list.push_back({"status",s.str()});
+
+    return list;
+}
+
+static void run_scenario(const Scenario &sc, size_t frame_bytes) {
+    current_windows = WindowRegistry();
+    auto terminal = std::make_unique<MainTerminalWindow>();
+    InputPipeline input(-1);
+
+    std::vector<double> repaint_us;
+    size_t lines = std::count(sc.data.begin(),sc.data.end(),'\n');
+    size_t dispatched = 0;
+
+    auto start = bench_clock::now();
+    const char *p = sc.data.data(), *end = p+sc.data.size();
+    while (p < end) {
+        // One "frame" worth of input...
+        const char *frame_end = std::min(end,p+frame_bytes);
+        while (p < frame_end) {
+            // Small enough bites that the line ring can't fill up on us
+            auto block = input.fill(p,std::min<size_t>(frame_end-p,8192));
+            p += block.size();
+            while (!block.empty()) {
+                auto len = std::min(block.find('\0'),block.size());
+                terminal->putString(block.substr(0,len));
+                block.remove_prefix(std::min(len+1,block.size()));
+            }
+            input.frame();
+            InputLine line;
+            while (input.pop(line)) {
+                dispatch_line(line.text);
+                input.release(line);
+                dispatched++;
+            }
+        }
+        // ...then the repaint
+        auto repaint_start = bench_clock::now();
+        repaint_windows({{.win=terminal.get(),.lock=nullptr}});
+        repaint_us.push_back(std::chrono::duration<double,std::micro>(bench_clock::now()-repaint_start).count());
+    }
+    snapshot_writer.flush(); // SAVEs count too, even if they finish in the background
+    double secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+
+    std::sort(repaint_us.begin(),repaint_us.end());
+    auto pct = [&](double p) {return repaint_us.empty() ? 0.0 : repaint_us[std::min(repaint_us.size()-1,size_t(p*repaint_us.size()))];};
+
+    std::cerr << std::fixed << std::setprecision(1)
+              << std::left << std::setw(10) << sc.name << std::right
+              << std::setw(12) << lines/secs
+              << std::setw(12) << sc.data.size()/secs/1024
+              << std::setw(10) << dispatched
+              << std::setw(10) << pct(0.5)
+              << std::setw(10) << pct(0.9)
+              << std::setw(10) << pct(0.99)
+              << std::setw(10) << (repaint_us.empty() ? 0.0 : repaint_us.back())
+              << std::setw(12) << peak_memory_kb()
+              << "\n";
+
+    current_windows = WindowRegistry();
+}
+
+int main(int argc, char* argv[]) {
+    size_t frame_bytes = 4096;
+    bool verbose = false;
+    std::vector<Scenario> scenarios;
+
+    for (int i=1;i<argc;i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--frame-bytes" && i+1<argc) {
+            frame_bytes = std::max(1,atoi(argv[++i]));
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else if (arg[0] != '-') {
+            std::ifstream file(argv[i],std::ios::binary);
+            if (!file) {
+                std::cerr << "Can't open " << arg << "\n";
+                return 1;
+            }
+            std::ostringstream data;
+            data << file.rdbuf();
+            if (CaptureReader::isCapture(data.str())) {
+                // Timing doesn't matter here, just want the bytes
+                CaptureReader reader(argv[i]);
+                CaptureReader::Record rec;
+                std::string bytes;
+                while (reader.next(rec)) bytes += rec.data;
+                scenarios.push_back({std::string(arg),std::move(bytes)});
+            } else {
+                scenarios.push_back({std::string(arg),data.str()});
+            }
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--frame-bytes N] [--verbose] [raw stream or capture files...]\n";
+            return 1;
+        }
+    }
+    if (scenarios.empty()) scenarios = builtin_scenarios();
+
+    // Environment variable still wins, e.g. SDL_VIDEODRIVER=offscreen
+    SDL_SetHint(SDL_HINT_VIDEODRIVER,"dummy");
+    if (SDL_Init(SDL_INIT_VIDEO)) throw sdl_error("SDL2 init error");
+    if (TTF_Init()) throw ttf_error("SDL2_TTF init error");
+
+    // All the debug chatter would just measure the console
+    if (!verbose) std::cout.rdbuf(nullptr);
+
+    std::cerr << std::left << std::setw(10) << "scenario" << std::right
+              << std::setw(12) << "lines/s"
+              << std::setw(12) << "KiB/s"
+              << std::setw(10) << "dispatch"
+              << std::setw(10) << "p50 us"
+              << std::setw(10) << "p90 us"
+              << std::setw(10) << "p99 us"
+              << std::setw(10) << "max us"
+              << std::setw(12) << "peak KiB"
+              << "\n";
+    for (auto &sc : scenarios) run_scenario(sc,frame_bytes);
+
+    SDL_Quit();
+    return 0;
+}
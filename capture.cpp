@@ -0,0 +1,73 @@
+#include "capture.hpp"
+#include <cerrno>
+
+static uint64_t now_us() {
+    return SDL_GetPerformanceCounter()*1000000/SDL_GetPerformanceFrequency();
+}
+
+static void put_varint(FILE *f, uint64_t val) {
+    while (val >= 0x80) {
+        fputc(int(val&0x7F)|0x80,f);
+        val >>= 7;
+    }
+    fputc(int(val),f);
+}
+
+// Returns false if the data runs out
+static bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &val) {
+    val = 0;
+    for (int shift=0;p<end && shift<64;shift+=7) {
+        uint8_t b = *p++;
+        val |= uint64_t(b&0x7F)<<shift;
+        if (!(b&0x80)) return true;
+    }
+    return false;
+}
+
+CaptureWriter::CaptureWriter(const std::string &path) {
+    file = fopen(path.c_str(),"wb");
+    if (!file) throw std::runtime_error("Can't open capture file "+path+" ("+strerror(errno)+")");
+    fwrite(capture_magic,1,sizeof(capture_magic),file);
+    fputc(capture_version,file);
+    start = now_us();
+}
+
+CaptureWriter::~CaptureWriter() {
+    fclose(file);
+}
+
+void CaptureWriter::write(std::string_view block) {
+    uint64_t t = now_us()-start;
+    put_varint(file,t-last_us);
+    put_varint(file,block.size());
+    fwrite(block.data(),1,block.size(),file);
+    fflush(file); // Want everything up to a crash in there
+    last_us = t;
+}
+
+
+CaptureReader::CaptureReader(const std::string &path) : map(path,true) {
+    base = map.data();
+    end = base + map.size();
+    if (!isCapture(std::string_view((const char *)base,end-base)) || base[sizeof(capture_magic)] != capture_version) {
+        throw std::runtime_error(path+" is not a capture file");
+    }
+    rewind();
+}
+
+void CaptureReader::rewind() {
+    pos = base + sizeof(capture_magic) + 1;
+    time_us = 0;
+}
+
+bool CaptureReader::next(Record &rec) {
+    uint64_t delta, len;
+    const uint8_t *p = pos;
+    // A truncated last record (e.g. from a crash) just ends the capture
+    if (!get_varint(p,end,delta) || !get_varint(p,end,len) || len > uint64_t(end-p)) return false;
+    time_us += delta;
+    rec.time_us = time_us;
+    rec.data = std::string_view((const char *)p,len);
+    pos = p+len;
+    return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "main.hpp"
+#include "mappedfile.hpp"
+#include <cstdio>
+
+// Capture files are the raw input bytes with their arrival times:
+//   "P2DBGCAP", version byte, then records of
+//   varint microseconds since the previous record, varint length, bytes
+constexpr char capture_magic[8] = {'P','2','D','B','G','C','A','P'};
+constexpr uint8_t capture_version = 1;
+
+class CaptureWriter {
+    private:
+        FILE *file;
+        uint64_t start, last_us = 0;
+    public:
+        CaptureWriter(const std::string &path);
+        ~CaptureWriter();
+        CaptureWriter(const CaptureWriter &) = delete;
+        CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+        void write(std::string_view block);
+};
+
+// Memory-maps a capture file, record data points straight into the mapping
+class CaptureReader {
+    private:
+        MappedFile map;
+        const uint8_t *base, *pos, *end;
+        uint64_t time_us = 0;
+    public:
+        struct Record {
+            uint64_t time_us; // Since start of capture
+            std::string_view data;
+        };
+
+        CaptureReader(const std::string &path);
+        CaptureReader(const CaptureReader &) = delete;
+        CaptureReader &operator=(const CaptureReader &) = delete;
+
+        bool next(Record &rec);
+        void rewind();
+
+        static bool isCapture(std::string_view data) {
+            return data.size() > sizeof(capture_magic) && !memcmp(data.data(),capture_magic,sizeof(capture_magic));
+        };
+};
@@ -0,0 +1,178 @@
+#include "dispatch.hpp"
+#include "terminal.hpp"
+#include "workers.hpp"
+#include "stats.hpp"
+#include <iostream>
+
+WindowRegistry current_windows;
+
+static bool trySetupWindow(std::string_view type, std::string_view args, uint32_t ns, std::string_view label) {
+
+    // Check for a name 
+    auto name_end = args.find(' ');
+    if (name_end == std::string::npos) return false;
+    std::string_view name = args.substr(0,name_end);
+    args = args.substr(name_end+1);
+
+    DEBUG_TRACE("Trying to setup window of type \"" << type << "\" with name \"" << name << "\"?\n");
+
+    DebugWindow *win = current_windows.find(name,ns);
+
+    if (type == "TERM") {
+        if (!win || typeid(*win)!=typeid(DebugTerminalWindow)) {
+            std::string auto_title = std::string(name) + " - " + std::string(type);
+            if (!label.empty()) auto_title = std::string(label) + ": " + auto_title;
+            win = current_windows.insert(name,std::make_unique<DebugTerminalWindow>(std::move(auto_title)),ns);
+        }
+    }
+
+    if (win) {
+        DEBUG_TRACE("parsing setup\n");
+        win->linesIn++;
+        win->parse_setup(args);
+        return true;
+    } else return false;
+
+    
+}
+
+
+void dispatch_line(std::string_view text, uint32_t ns, std::string_view label) {
+    auto ident_end = text.find(' ',1);
+    if (ident_end == std::string::npos) return;
+    auto ident = text.substr(1,ident_end-1);
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (DebugWindow *win = current_windows.find(ident,ns)) {
+        // Dispatch to window
+        win->linesIn++;
+        win->parse_data(text.substr(ident_end+1));
+    } else if (trySetupWindow(ident,text.substr(ident_end+1),ns,label)) {
+        
+    }
+    perf_stats.parseTicks += SDL_GetPerformanceCounter()-start;
+    perf_stats.linesDispatched++;
+}
+
+// The existing window a line goes to, and the data for it.
+// Null for setup lines (and anything else that isn't data for a window).
+static DebugWindow *data_target(std::string_view text, uint32_t ns, std::string_view &data) {
+    auto ident_end = text.find(' ',1);
+    if (ident_end == std::string::npos) return nullptr;
+    data = text.substr(ident_end+1);
+    return current_windows.find(text.substr(1,ident_end-1),ns);
+}
+
+size_t coalesce_lines(std::vector<std::string_view> &lines, size_t budget, uint32_t ns) {
+    static std::vector<DebugWindow *> targets;
+    static std::vector<std::string_view> data;
+    targets.resize(lines.size());
+    data.resize(lines.size());
+    std::unordered_map<DebugWindow *,size_t> counts;
+    // Lines get looked at with the windows as they are now, so only up to the first
+    // setup line. That one might resize or replace a window.
+    size_t stop = lines.size();
+    for (size_t i=0;i<stop;i++) {
+        if (lines[i].empty()) continue;
+        targets[i] = data_target(lines[i],ns,data[i]);
+        if (targets[i]) counts[targets[i]]++;
+        else stop = i;
+    }
+
+    // The line before, for each window that's over budget
+    struct Last {
+        size_t index;
+        LineEffect effect;
+        bool settledBefore; // The window wasn't waiting for an argument when it came
+    };
+    std::unordered_map<DebugWindow *,Last> last;
+    size_t taken = 0;
+    for (size_t i=0;i<stop;i++) {
+        if (lines[i].empty()) continue;
+        DebugWindow *win = targets[i];
+        if (counts[win] <= budget) continue;
+        LineEffect effect = win->data_effect(data[i]);
+        bool settledBefore = win->data_settled(); // Nothing's been dispatched yet
+        if (auto prev = last.find(win); prev != last.end()) {
+            auto &before = prev->second;
+            // How this line finds the window, whether or not the earlier one stays.
+            // The earlier line's effect only holds if it didn't come in mid-sequence itself.
+            settledBefore = before.settledBefore && before.effect.known && before.effect.settled;
+            if (settledBefore && effect.known &&
+                ((effect.wipes && before.effect.keepsColors) ||
+                 (effect.placed && before.effect.placed && effect.shape == before.effect.shape))) {
+                lines[before.index] = {};
+                taken++;
+            }
+        }
+        last[win] = {.index=i,.effect=std::move(effect),.settledBefore=settledBefore};
+    }
+    return taken;
+}
+
+size_t drop_lines(std::vector<std::string_view> &lines, size_t count, uint32_t ns) {
+    // Whether each window will be waiting for an argument from its next line
+    std::unordered_map<DebugWindow *,bool> settled;
+    bool pastSetup = false;
+    size_t taken = 0;
+    for (size_t i=0;i<lines.size() && taken<count;i++) {
+        std::string_view data;
+        if (lines[i].empty()) continue;
+        DebugWindow *win = data_target(lines[i],ns,data);
+        if (!win) {
+            // Setup lines always go through, and nobody knows what they did to which window
+            settled.clear();
+            pastSetup = true;
+            continue;
+        }
+        auto state = settled.find(win);
+        bool settledBefore = state != settled.end() ? state->second : !pastSetup && win->data_settled();
+        LineEffect effect = win->data_effect(data);
+        // Commands always go through. A line can only go if it doesn't carry an argument
+        // for the line before and doesn't leave one for the line after either.
+        if (settledBefore && effect.known && effect.settled) {
+            lines[i] = {};
+            taken++;
+        } else {
+            settled[win] = settledBefore && effect.known && effect.settled;
+        }
+    }
+    return taken;
+}
+
+void repaint_windows(const std::vector<SharedWindow> &shared) {
+    static WorkerPool pool (std::max(0,SDL_GetCPUCount()-1));
+    static std::vector<SharedWindow> batch;
+    batch.clear();
+    for (auto iter=current_windows.begin();iter!=current_windows.end();) {
+        auto &win = iter->second->win;
+        if (win->shouldClose) {
+            iter = current_windows.erase(iter);
+        } else {
+            if(win->shouldRepaint()) batch.push_back({win.get(),nullptr});
+            ++iter;
+        }
+    }
+    for (auto &job : shared) {
+        SDL_Lock lock (job.lock); // Auto unlocks when it goes out of scope
+        if (job.win->shouldRepaint()) batch.push_back(job);
+    }
+
+    if (batch.empty()) return;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    for (auto &job : batch) {
+        SDL_Lock lock (job.lock); // Auto unlocks when it goes out of scope
+        job.win->prepare();
+    }
+    pool.run(batch.size(),[](size_t i) {
+        SDL_Lock lock (batch[i].lock); // Auto unlocks when it goes out of scope
+        batch[i].win->render();
+    });
+    for (auto &job : batch) job.win->present();
+
+    Uint64 ticks = SDL_GetPerformanceCounter()-start;
+    perf_stats.frames++;
+    perf_stats.repaintTicks += ticks;
+    perf_stats.repaintMaxTicks = std::max(perf_stats.repaintMaxTicks,ticks);
+    perf_stats.windowsRendered += batch.size();
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "main.hpp"
+
+extern WindowRegistry current_windows;
+
+// Hands a "`name ..." line to its window, or sets up a new window.
+// ns is the namespace of the input source, label goes into new window titles.
+void dispatch_line(std::string_view line, uint32_t ns = 0, std::string_view label = {});
+// For a backlog of lines about to be dispatched. Lines that get taken out are set empty.
+// coalesce_lines takes out data lines that a later line for the same window completely
+// draws over, but only for windows that got more than budget lines, and only up to the
+// first setup line (the lines past it are for windows that might not look like this anymore).
+// drop_lines takes out up to count of the oldest data lines that only draw, never one
+// that takes or leaves an argument for a neighbouring line.
+// Both return how many they took out.
+size_t coalesce_lines(std::vector<std::string_view> &lines, size_t budget, uint32_t ns = 0);
+size_t drop_lines(std::vector<std::string_view> &lines, size_t count, uint32_t ns = 0);
+// A window that another thread writes to, only rendered while holding its lock
+struct SharedWindow {
+    AppWindow *win;
+    SDL_mutex *lock;
+};
+// Drops closed debug windows and repaints the dirty ones (plus the shared ones),
+// rendering in parallel on the worker pool
+void repaint_windows(const std::vector<SharedWindow> &shared = {});
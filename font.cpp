@@ -3,28 +3,228 @@
 
 FontCache font_cache;
 
+FontCache::FontCache() {
+    openLock = SDL_CreateMutex();
+    if (!openLock) throw sdl_error("Failed to create font cache lock");
+}
+
+FontCache::~FontCache() {
+    cmap.clear(); // Closes the fonts
+    SDL_DestroyMutex(openLock);
+}
+
+std::shared_ptr<MappedFile> FontCache::loadFile(const std::string &name) {
+    auto &weak = files[name];
+    if (auto file = weak.lock()) return file;
+
+    char *base = SDL_GetBasePath();
+    std::string ttf_name = std::string(base ? base : "") + "ttf/" + name + ".ttf";
+    SDL_free(base);
+    //ttf_name += props.bold ? (props.italic ? "-BoldItalic" : "-Bold") : (props.italic ? "-Italic" : "-Regular");
+    auto file = std::make_shared<MappedFile>(ttf_name);
+    weak = file;
+    return file;
+}
+
+TTF_Font *FontCache::openFont(const FontProperties &props, std::shared_ptr<MappedFile> &file) {
+    SDL_Lock lock (openLock); // Auto unlocks when it goes out of scope
+    if (!file) file = loadFile(props.name);
+    SDL_RWops *rw = SDL_RWFromConstMem(file->data(),file->size());
+    if (!rw) throw sdl_error("Failed to open font data for "+props.name);
+    TTF_Font *fon = TTF_OpenFontRW(rw,1,props.size); // Closes rw when done
+    if (!fon) throw ttf_error("Failed to load font "+props.name+" at size "+std::to_string(props.size));
+    TTF_SetFontHinting(fon,TTF_HINTING_MONO);
+    return fon;
+}
+
+static const PrebakedFont *find_prebaked(const FontProperties &props) {
+    if (props.bold || props.italic) return nullptr;
+    for (size_t i=0;i<prebaked_font_count;i++) {
+        if (prebaked_fonts[i].size == props.size && props.name == prebaked_fonts[i].name) return &prebaked_fonts[i];
+    }
+    return nullptr;
+}
+
 FontCheckout FontCache::get(FontProperties props) {
-    if (!cmap.count(props)) {
+    auto found = cmap.find(props);
+    if (found == cmap.end()) {
+        auto fresh = cmap.try_emplace(props).first;
+        CacheLine &line = fresh->second;
+        try {
+            if (const PrebakedFont *baked = find_prebaked(props)) {
+                // No file access at all until somebody wants a glyph that isn't in there
+                line.glyphDims = baked->cell;
+                line.atlas.setCellSize(line.glyphDims);
+                line.atlas.preload(*baked);
+                line.atlas.setFontLoader([this,props,&line]() {return openFont(props,line.file);});
+            } else {
+                TTF_Font *fon = openFont(props,line.file);
+                line.atlas.setFont(fon);
+                // Only valid for monospace
+                int h = TTF_FontLineSkip(fon);
+                int minx,maxx,miny,maxy,advance;
+                TTF_GlyphMetrics(fon,'W',&minx,&maxx,&miny,&maxy,&advance);
+                line.glyphDims = {advance,h};
+                line.atlas.setCellSize(line.glyphDims);
+            }
+        } catch (...) {
+            cmap.erase(fresh);
+            throw;
+        }
+        found = fresh;
+    }
+
+    return FontCheckout(&found->second,this);
+}
+
+void FontCache::getAtlasStats(uint64_t &hits, uint64_t &misses) {
+    hits = evictedHits;
+    misses = evictedMisses;
+    for (auto &[props,line] : cmap) {
+        hits += line.atlas.getHits();
+        misses += line.atlas.getMisses();
+    }
+}
+
+void FontCache::trim() {
+    for (;;) {
+        size_t idle = 0;
+        auto oldest = cmap.end();
+        for (auto iter = cmap.begin(); iter != cmap.end(); ++iter) {
+            if (iter->second.users) continue;
+            idle += FONT_OVERHEAD + iter->second.atlas.memoryUsed();
+            if (oldest == cmap.end() || iter->second.lastUsed < oldest->second.lastUsed) oldest = iter;
+        }
+        if (idle <= IDLE_BUDGET) return;
+        evictedHits += oldest->second.atlas.getHits();
+        evictedMisses += oldest->second.atlas.getMisses();
+        cmap.erase(oldest); // Unmaps the file too if it was the last size
+    }
+}
+
+void FontCheckout::release() {
+    // Nobody is drawing with this size anymore (e.g. TEXTSIZE changed), it's up for eviction now
+    if (--fon->users == 0) {
+        fon->lastUsed = ++cache->useClock;
+        cache->trim();
+    }
+}
 
-        std::string ttf_name = std::string(SDL_GetBasePath()) + "ttf/" + props.name;
-        //ttf_name += props.bold ? (props.italic ? "-BoldItalic" : "-Bold") : (props.italic ? "-Italic" : "-Regular");
-        ttf_name += ".ttf";
-        TTF_Font *fon = TTF_OpenFont(ttf_name.c_str(),props.size);
-        if (!fon) throw ttf_error("Failed to load font from "+ttf_name);
-        TTF_SetFontHinting(fon,TTF_HINTING_MONO);
 
-        cmap[props] = CacheLine {.font=fon};
+GlyphAtlas::GlyphAtlas() {
+    mutex = SDL_CreateMutex();
+    if (!mutex) throw sdl_error("Failed to create glyph atlas lock");
+}
+
+GlyphAtlas::~GlyphAtlas() {
+    clear();
+    if (font) TTF_CloseFont(font);
+    SDL_DestroyMutex(mutex);
+}
+
+void GlyphAtlas::setCellSize(Dimension dims) {
+    if (dims.width != cell.width || dims.height != cell.height) clear();
+    cell = dims;
+    cellBytes = size_t(cell.width)*cell.height;
+}
+
+void GlyphAtlas::clear() {
+    for (auto &page : pages) delete page.exchange(nullptr);
+    pageCount = 0;
+}
+
+GlyphAtlas::Page *GlyphAtlas::getPage(int index) {
+    Page *page = pages[index].load(std::memory_order_relaxed);
+    if (!page) {
+        page = new Page;
+        pageCount.fetch_add(1,std::memory_order_relaxed);
+        page->coverage = std::make_unique<uint8_t[]>(cellBytes*256);
+        pages[index].store(page,std::memory_order_release);
+    }
+    return page;
+}
+
+TTF_Font *GlyphAtlas::loadFont() {
+    if (!font) {
+        if (!fontLoader) throw std::runtime_error("Glyph atlas has no font");
+        font = fontLoader();
+    }
+    return font;
+}
+
+TTF_Font *GlyphAtlas::getFont() {
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    return loadFont();
+}
+
+void GlyphAtlas::preload(const PrebakedFont &baked) {
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    const uint8_t *src = baked.data, *end = baked.data+baked.dataSize;
+    for (uint ch=baked.first;ch<uint(baked.first+baked.count) && src<end;ch++) {
+        Page *page = getPage(ch>>8);
+        uint8_t *dst = page->coverage.get() + (ch&255)*cellBytes;
+        // Zero runs can just be skipped, fresh pages are all zeros
+        for (size_t i=0;i<cellBytes && src<end;) {
+            if (uint8_t val = *src++) dst[i++] = val;
+            else if (src<end) i += *src++;
+        }
+        page->present[(ch&255)>>6].fetch_or(uint64_t(1)<<(ch&63),std::memory_order_release);
     }
+}
+
+void GlyphAtlas::rasterize(Page &page, uint16_t ch) {
+    int slot = ch&255;
+    uint8_t *base = page.coverage.get() + slot*cellBytes;
+    memset(base,0,cellBytes);
 
-    return FontCheckout(&cmap[props],this);
+    // Palette index 0 is background and 255 is full foreground coverage
+    SDL_Surface *glyph = TTF_RenderGlyph_Shaded(loadFont(),ch,{255,255,255,255},{0,0,0,255});
+    if (!glyph) throw ttf_error("Failed to render glyph "+std::to_string(int(ch)));
+    int w = std::min(glyph->w,cell.width), h = std::min(glyph->h,cell.height);
+    for (int y=0;y<h;y++) memcpy(base+y*cell.width,(uint8_t *)glyph->pixels+y*glyph->pitch,w);
+    SDL_FreeSurface(glyph);
+
+    page.present[slot>>6].fetch_or(uint64_t(1)<<(slot&63),std::memory_order_release);
 }
 
-Dimension FontCheckout::getGlyphDims() {
-    // Only valid for monospace
-    int h = TTF_FontLineSkip(get());
-    int minx,maxx,miny,maxy,advance;
-    TTF_GlyphMetrics(get(),'W',&minx,&maxx,&miny,&maxy,&advance);
-    return {advance,h};
+const uint8_t *GlyphAtlas::getGlyph(wchar_t wch) {
+    uint16_t ch = wch; // SDL_ttf only takes UCS-2 here anyways
+    int slot = ch&255;
+    uint64_t bit = uint64_t(1)<<(slot&63);
+    Page *page = pages[ch>>8].load(std::memory_order_acquire);
+    if (page && (page->present[slot>>6].load(std::memory_order_acquire) & bit)) return page->coverage.get() + slot*cellBytes;
+
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    page = getPage(ch>>8);
+    // Somebody else might have gotten to it while we waited
+    if (!(page->present[slot>>6].load(std::memory_order_relaxed) & bit)) {
+        misses.fetch_add(1,std::memory_order_relaxed);
+        rasterize(*page,ch);
+    }
+    return page->coverage.get() + slot*cellBytes;
 }
 
+void GlyphPainter::paint(const uint8_t *coverage, SDL_Color fg, SDL_Color bg, int x, int y) {
+    // Runs of same-colored cells are the norm, so the ramp rarely needs redoing
+    if (!rampValid || memcmp(&this->fg,&fg,sizeof(SDL_Color)) || memcmp(&this->bg,&bg,sizeof(SDL_Color))) {
+        const SDL_PixelFormat *fmt = target->format;
+        for (int i=0;i<256;i++) {
+            uint32_t r = bg.r + (fg.r-bg.r)*i/255;
+            uint32_t g = bg.g + (fg.g-bg.g)*i/255;
+            uint32_t b = bg.b + (fg.b-bg.b)*i/255;
+            ramp[i] = (r<<fmt->Rshift)|(g<<fmt->Gshift)|(b<<fmt->Bshift)|fmt->Amask;
+        }
+        this->fg = fg;
+        this->bg = bg;
+        rampValid = true;
+    }
 
+    int w = std::min(cell.width,target->w-x), h = std::min(cell.height,target->h-y);
+    if (x < 0 || y < 0 || w <= 0 || h <= 0) return;
+    uint8_t *dst = (uint8_t *)target->pixels + y*target->pitch + x*4;
+    for (int row=0;row<h;row++) {
+        uint32_t *out = (uint32_t *)(dst+row*target->pitch);
+        const uint8_t *cov = coverage+row*cell.width;
+        for (int col=0;col<w;col++) out[col] = ramp[cov[col]];
+    }
+}
@@ -1,6 +1,12 @@
 #pragma once
 #include "main.hpp"
+#include "mappedfile.hpp"
+#include "prebaked.hpp"
 #include <unordered_map>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
 
 const std::string default_typeface = "Parallax";
 
@@ -19,25 +25,111 @@ namespace std {
     template<>
     struct hash<FontProperties> {
         inline size_t operator()(const FontProperties& props) const {
-            return std::hash<std::string>{}(props.name)+props.size+props.bold+props.italic;
+            // Sizes next to each other shouldn't land next to each other
+            size_t seed = std::hash<std::string>{}(props.name);
+            auto combine = [&seed](size_t val) {seed ^= val + size_t(0x9e3779b97f4a7c15ull) + (seed<<6) + (seed>>2);};
+            combine(std::hash<int>{}(props.size));
+            combine(props.bold | props.italic<<1);
+            return seed;
         }
     };
 }
 
 class FontCheckout;
 
+// Every glyph of a font gets rasterized once into an 8-bit coverage atlas,
+// then gets colored by a GlyphPainter when drawing.
+// Lookups are safe from any number of render threads at once.
+// The atlas owns the TTF_Font, which only gets opened for glyphs that weren't prebaked.
+class GlyphAtlas {
+    private:
+        // Coverage for 256 glyphs, cell after cell
+        struct Page {
+            std::unique_ptr<uint8_t[]> coverage;
+            std::atomic<uint64_t> present[4] = {};
+        };
+        // Indexed by codepoint>>8. Pages only get added until clear(), so readers don't need the lock
+        std::atomic<Page *> pages[256] = {};
+        SDL_mutex *mutex; // Held while rasterizing, TTF_Font isn't thread safe
+        TTF_Font *font = nullptr;
+        std::function<TTF_Font *()> fontLoader; // For when font is still null
+        Dimension cell = {0,0};
+        size_t cellBytes = 0;
+        std::atomic<uint64_t> lookups = 0, misses = 0;
+        std::atomic<size_t> pageCount = 0;
+
+        Page *getPage(int index); // With the lock held
+        TTF_Font *loadFont(); // Same
+        void rasterize(Page &page, uint16_t ch);
+    public:
+        GlyphAtlas();
+        GlyphAtlas(const GlyphAtlas &) = delete;
+        GlyphAtlas &operator=(const GlyphAtlas &) = delete;
+        ~GlyphAtlas();
+
+        void setCellSize(Dimension dims);
+        void setFont(TTF_Font *opened) {font = opened;};
+        void setFontLoader(std::function<TTF_Font *()> loader) {fontLoader = std::move(loader);};
+        TTF_Font *getFont();
+        void preload(const PrebakedFont &baked);
+        // Returns cell width*height coverage bytes, 0 is background and 255 is foreground
+        const uint8_t *getGlyph(wchar_t ch);
+        void clear(); // Only while nobody is drawing
 
+        void countLookups(uint64_t n) {lookups.fetch_add(n,std::memory_order_relaxed);};
+        uint64_t getHits() const {return lookups.load(std::memory_order_relaxed)-getMisses();};
+        uint64_t getMisses() const {return misses.load(std::memory_order_relaxed);};
+        size_t memoryUsed() const {return pageCount.load(std::memory_order_relaxed)*(sizeof(Page)+cellBytes*256);};
+};
+
+// Draws atlas glyphs into a 32 bit surface.
+// Each rendering thread needs its own, since it keeps the last color ramp around.
+class GlyphPainter {
+    private:
+        SDL_Surface *target;
+        Dimension cell;
+        SDL_Color fg = {0,0,0,0}, bg = {0,0,0,0};
+        bool rampValid = false;
+        uint32_t ramp[256];
+    public:
+        GlyphPainter(SDL_Surface *target, Dimension cell) : target{target},cell{cell} {};
+        void paint(const uint8_t *coverage, SDL_Color fg, SDL_Color bg, int x, int y);
+};
+
+
+// Every size of a font is its own TTF_Font, but they all share one mapping of the file.
+// Sizes nobody uses anymore stick around (TEXTSIZE animations tend to come back to them)
+// until they add up to more than IDLE_BUDGET, then the least recently used go first.
 class FontCache {
     friend FontCheckout;
     private:
         struct CacheLine {
-            TTF_Font *font;
-            uint users;
+            std::shared_ptr<MappedFile> file; // Has to outlive the atlas' font, FreeType reads from it as it goes
+            uint users = 0;
+            uint64_t lastUsed = 0; // Of useClock, when users last dropped to 0
+            Dimension glyphDims;
+            GlyphAtlas atlas;
         };
         std::unordered_map<FontProperties,CacheLine> cmap;
+        std::unordered_map<std::string,std::weak_ptr<MappedFile>> files;
+        uint64_t useClock = 0;
+        uint64_t evictedHits = 0, evictedMisses = 0; // So the stats don't go backwards
+        // Opening can happen on a render thread (for a prebaked font's first odd glyph),
+        // this keeps it away from files and from FreeType opening something else at the same time.
+        SDL_mutex *openLock;
+
+        TTF_Font *openFont(const FontProperties &props, std::shared_ptr<MappedFile> &file);
+        std::shared_ptr<MappedFile> loadFile(const std::string &name);
+        void trim();
+    public:
+        FontCache();
+        ~FontCache();
+        static constexpr size_t IDLE_BUDGET = 8<<20;
+        static constexpr size_t FONT_OVERHEAD = 64<<10; // Rough guess at what FreeType keeps per size
 
-    public:  
         FontCheckout get(FontProperties props);
+        void getAtlasStats(uint64_t &hits, uint64_t &misses); // Summed over all fonts
+        size_t size() const {return cmap.size();};
 };
 
 
@@ -49,15 +141,27 @@ class FontCheckout {
         FontCheckout(FontCache::CacheLine *fon,FontCache *cache) : fon{fon},cache{cache} {
             fon->users++;
         };
-        FontCheckout(const FontCache &) {
+        void release();
+    public:
+        FontCheckout(const FontCheckout &that) : fon{that.fon},cache{that.cache} {
             fon->users++;
         };
-    public:
+        FontCheckout &operator=(const FontCheckout &that) {
+            if (that.fon != fon) {
+                that.fon->users++;
+                release();
+                fon = that.fon;
+                cache = that.cache;
+            }
+            return *this;
+        };
         ~FontCheckout() {
-            --fon->users;
+            release();
         }
-        TTF_Font *get() {return fon->font;};
-        Dimension getGlyphDims();
+        TTF_Font *get() {return fon->atlas.getFont();};
+        Dimension getGlyphDims() {return fon->glyphDims;};
+        GlyphAtlas &getAtlas() {return fon->atlas;};
+        const uint8_t *getGlyph(wchar_t ch) {return fon->atlas.getGlyph(ch);};
 
 };
 
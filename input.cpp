@@ -0,0 +1,151 @@
+#include "input.hpp"
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <poll.h>
+#endif
+
+InputPipeline::InputPipeline(int fd) : fd{fd} {
+    free_mutex = SDL_CreateMutex();
+    if (!free_mutex) throw sdl_error("Failed to create chunk pool lock");
+    #ifdef _WIN32
+    if (fd >= 0) _setmode(fd,_O_BINARY);
+    #endif
+    cur = newChunk();
+}
+
+InputPipeline::~InputPipeline() {
+    // Only safe once both threads are done with it
+    if (cur) unref(cur);
+    for (auto chunk : freeChunks) delete chunk;
+    SDL_DestroyMutex(free_mutex);
+}
+
+InputChunk *InputPipeline::newChunk() {
+    InputChunk *chunk = nullptr;
+    {
+        SDL_Lock lock (free_mutex); // Auto unlocks when it goes out of scope
+        if (!freeChunks.empty()) {
+            chunk = freeChunks.back();
+            freeChunks.pop_back();
+        }
+    }
+    if (!chunk) chunk = new InputChunk;
+    chunk->refs.store(1,std::memory_order_relaxed); // Producer's reference
+    chunk->used = 0;
+    return chunk;
+}
+
+void InputPipeline::unref(InputChunk *chunk) {
+    if (chunk->refs.fetch_sub(1,std::memory_order_acq_rel) == 1) {
+        SDL_Lock lock (free_mutex); // Auto unlocks when it goes out of scope
+        freeChunks.push_back(chunk);
+    }
+}
+
+size_t InputPipeline::makeRoom() {
+    // Keep one byte spare so an overlong line can always be terminated
+    if (cur->used >= InputChunk::SIZE-1) {
+        if (lineStart == 0) {
+            // Line fills an entire chunk, just cut it here
+            emitLine(cur->data,cur->data+cur->used);
+            lineStart = scanPos = cur->used;
+        }
+        // Carry the partial line over into a fresh chunk
+        InputChunk *next = newChunk();
+        size_t partial = cur->used - lineStart;
+        memcpy(next->data,cur->data+lineStart,partial);
+        next->used = partial;
+        scanPos -= lineStart;
+        lineStart = 0;
+        unref(cur);
+        cur = next;
+    }
+    return InputChunk::SIZE-1-cur->used;
+}
+
+std::string_view InputPipeline::commit(size_t len) {
+    std::string_view fresh(cur->data+cur->used,len);
+    cur->used += len;
+    bytesIn.store(bytesIn.load(std::memory_order_relaxed)+len,std::memory_order_relaxed);
+    return fresh;
+}
+
+std::string_view InputPipeline::fill(bool wait) {
+    size_t space = makeRoom();
+    ssize_t got;
+    for (;;) {
+        got = read(fd,cur->data+cur->used,space);
+        if (got >= 0) break;
+        if (errno == EINTR) continue;
+        #ifndef _WIN32
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!wait) return {};
+            // Non-blocking source (serial port), wait until there's a bunch to read
+            struct pollfd pfd = {.fd=fd,.events=POLLIN};
+            poll(&pfd,1,-1);
+            continue;
+        }
+        #endif
+        break;
+    }
+    if (got <= 0) {
+        eof = true;
+        return {};
+    }
+    return commit(got);
+}
+
+std::string_view InputPipeline::fill(const char *data, size_t len) {
+    size_t count = std::min(makeRoom(),len);
+    memcpy(cur->data+cur->used,data,count);
+    return commit(count);
+}
+
+void InputPipeline::frame() {
+    char *d = cur->data;
+    uint64_t framed = 0;
+    while (scanPos < cur->used) {
+        char *seg = d+scanPos;
+        size_t avail = cur->used-scanPos;
+        char *term = (char *)memchr(seg,'\n',avail);
+        size_t seglen = term ? term-seg : avail;
+        // NUL also ends a line
+        if (char *nul = (char *)memchr(seg,0,seglen)) {
+            term = nul;
+            seglen = nul-seg;
+        }
+        if (!term) {
+            scanPos = cur->used; // Incomplete, wait for more data
+            break;
+        }
+        scanPos += seglen+1;
+        emitLine(d+lineStart,term);
+        lineStart = scanPos;
+        framed++;
+    }
+    if (framed) linesIn.store(linesIn.load(std::memory_order_relaxed)+framed,std::memory_order_relaxed);
+}
+
+void InputPipeline::emitLine(char *start, char *end) {
+    // Strip carriage returns (usually just the one before the LF)
+    if (char *cr = (char *)memchr(start,'\r',end-start)) {
+        char *w = cr;
+        for (char *r = cr;r<end;r++) if (*r != '\r') *w++ = *r;
+        end = w;
+    }
+    *end = 0;
+
+    // Only DEBUG commands need to go to the main thread
+    if (end == start || *start != '`') return;
+
+    cur->refs.fetch_add(1,std::memory_order_relaxed);
+    InputLine line = {.text=std::string_view(start,end-start),.chunk=cur};
+    // Main thread is behind, wait for it. Even with --overload drop, only the main thread drops
+    // lines, it can tell which ones are safe to lose.
+    while (!lines.push(line)) SDL_Delay(1);
+}
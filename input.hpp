@@ -0,0 +1,126 @@
+#pragma once
+#include "main.hpp"
+#include <atomic>
+#include <array>
+#include <vector>
+
+// Lock-free queue for exactly one producer thread and one consumer thread
+template<typename T, size_t N>
+class SPSCRing {
+    static_assert((N & (N-1)) == 0, "Ring size must be a power of two");
+    private:
+        std::array<T,N> slots;
+        alignas(64) std::atomic<size_t> head = 0; // Next slot to read
+        alignas(64) std::atomic<size_t> tail = 0; // Next slot to write
+    public:
+        bool push(const T &val) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) >= N) return false;
+            slots[t & (N-1)] = val;
+            tail.store(t+1,std::memory_order_release);
+            return true;
+        };
+        bool pop(T &val) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) return false;
+            val = slots[h & (N-1)];
+            head.store(h+1,std::memory_order_release);
+            return true;
+        };
+        size_t size() const {
+            return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+        };
+        static constexpr size_t capacity() {return N;};
+};
+
+// Same thing for a plain stream of bytes, taking and handing out as much as fits at once
+template<size_t N>
+class SPSCByteRing {
+    static_assert((N & (N-1)) == 0, "Ring size must be a power of two");
+    private:
+        std::unique_ptr<char[]> buf {new char[N]};
+        alignas(64) std::atomic<size_t> head = 0;
+        alignas(64) std::atomic<size_t> tail = 0;
+    public:
+        // Returns how much actually went in
+        size_t write(const char *data, size_t len) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            len = std::min(len,N - (t - head.load(std::memory_order_acquire)));
+            size_t first = std::min(len,N - (t & (N-1)));
+            memcpy(&buf[t & (N-1)],data,first);
+            memcpy(&buf[0],data+first,len-first);
+            tail.store(t+len,std::memory_order_release);
+            return len;
+        };
+        // What's there in one piece, the rest (past the wraparound) comes after consume
+        std::string_view peek() const {
+            size_t h = head.load(std::memory_order_relaxed);
+            size_t avail = tail.load(std::memory_order_acquire) - h;
+            return {&buf[h & (N-1)],std::min(avail,N - (h & (N-1)))};
+        };
+        void consume(size_t len) {
+            head.store(head.load(std::memory_order_relaxed)+len,std::memory_order_release);
+        };
+        size_t size() const {
+            return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+        };
+        static constexpr size_t capacity() {return N;};
+};
+
+struct InputChunk {
+    static constexpr size_t SIZE = 64*1024;
+    std::atomic<uint> refs;
+    size_t used;
+    char data[SIZE];
+};
+
+// A debug line living inside an InputChunk. The text is always NUL-terminated.
+struct InputLine {
+    std::string_view text;
+    InputChunk *chunk;
+};
+
+// Reads raw bytes in bulk and frames them into lines in-place,
+// lines are handed to the main thread without copying
+class InputPipeline {
+    private:
+        int fd;
+        bool eof = false;
+        InputChunk *cur = nullptr;
+        size_t lineStart = 0, scanPos = 0;
+
+        SPSCRing<InputLine,4096> lines;
+        std::vector<InputChunk *> freeChunks;
+        SDL_mutex *free_mutex;
+
+        // Only written by the producer, read from anywhere
+        std::atomic<uint64_t> bytesIn = 0, linesIn = 0;
+
+        InputChunk *newChunk();
+        size_t makeRoom();
+        std::string_view commit(size_t len);
+        void unref(InputChunk *chunk);
+        void emitLine(char *start, char *end);
+    public:
+        InputPipeline(int fd); // fd can be -1 if only fed from memory
+        ~InputPipeline();
+        InputPipeline(const InputPipeline &) = delete;
+        InputPipeline &operator=(const InputPipeline &) = delete;
+
+        // Producer side, fill returns the raw bytes just added (empty on EOF).
+        // Without wait, it also comes back empty when a non-blocking fd has nothing yet.
+        std::string_view fill(bool wait = true);
+        std::string_view fill(const char *data, size_t len); // From memory instead of fd, takes as much as fits
+        void frame();
+        bool atEOF() const {return eof;};
+        int getFD() const {return fd;};
+
+        // Consumer side
+        bool pop(InputLine &line) {return lines.pop(line);};
+        void release(const InputLine &line) {unref(line.chunk);};
+        size_t pending() const {return lines.size();};
+        static constexpr size_t capacity() {return decltype(lines)::capacity();};
+
+        uint64_t bytesRead() const {return bytesIn.load(std::memory_order_relaxed);};
+        uint64_t linesRead() const {return linesIn.load(std::memory_order_relaxed);};
+};
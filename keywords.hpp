@@ -0,0 +1,73 @@
+#pragma once
+#include <array>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+// Case-insensitive symbol -> value tables with a perfect hash that gets
+// found at compile time, so a lookup is one hash and one compare.
+// Every window type keeps its own tables next to its parser, e.g.
+//   enum class FooSym {BAR,BAZ};
+//   static constexpr auto foo_keywords = make_keyword_table<FooSym>({{"BAR",FooSym::BAR},{"BAZ",FooSym::BAZ}});
+//   if (auto sym = foo_keywords.find(symbol)) switch (*sym) {...}
+
+constexpr char ascii_upper(char c) {
+    return c >= 'a' && c <= 'z' ? c - ('a'-'A') : c;
+}
+
+template<typename V, size_t N>
+class KeywordTable {
+    public:
+        struct Entry {
+            std::string_view key;
+            V value;
+        };
+    private:
+        static constexpr size_t SLOTS = [] {size_t s = 1; while (s < N*2) s <<= 1; return s;}();
+        std::array<Entry,SLOTS> slots {};
+        uint32_t seed = 0;
+
+        static constexpr uint32_t hash(std::string_view str, uint32_t seed) {
+            uint32_t h = seed ^ 2166136261u ^ uint32_t(str.size());
+            for (char c : str) h = (h ^ uint8_t(ascii_upper(c))) * 16777619u;
+            return h ^ (h >> 15);
+        }
+        static constexpr bool equal(std::string_view a, std::string_view b) {
+            if (a.size() != b.size()) return false;
+            for (size_t i=0;i<a.size();i++) if (ascii_upper(a[i]) != ascii_upper(b[i])) return false;
+            return true;
+        }
+    public:
+        constexpr KeywordTable(const std::pair<std::string_view,V> (&entries)[N]) {
+            for (seed = 0;seed < 100000;seed++) {
+                std::array<bool,SLOTS> taken {};
+                bool ok = true;
+                for (size_t i=0;i<N && ok;i++) {
+                    size_t slot = hash(entries[i].first,seed) & (SLOTS-1);
+                    if (taken[slot]) ok = false;
+                    taken[slot] = true;
+                }
+                if (ok) break;
+            }
+            // Only ever happens with duplicate keywords, breaks the constant evaluation
+            if (seed == 100000) throw std::logic_error("No perfect hash for keyword table");
+            for (size_t i=0;i<N;i++) {
+                Entry &e = slots[hash(entries[i].first,seed) & (SLOTS-1)];
+                e.key = entries[i].first;
+                e.value = entries[i].second;
+            }
+        }
+
+        // Returns nullptr for unknown symbols
+        constexpr const V *find(std::string_view symbol) const {
+            const Entry &e = slots[hash(symbol,seed) & (SLOTS-1)];
+            return equal(e.key,symbol) && !symbol.empty() ? &e.value : nullptr;
+        }
+        constexpr bool contains(std::string_view symbol) const {return find(symbol) != nullptr;};
+};
+
+template<typename V, size_t N>
+constexpr KeywordTable<V,N> make_keyword_table(const std::pair<std::string_view,V> (&entries)[N]) {
+    return KeywordTable<V,N>(entries);
+}
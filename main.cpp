@@ -1,427 +1,556 @@
 #include "main.hpp"
 #include "terminal.hpp"
 #include "font.hpp"
+#include "input.hpp"
+#include "dispatch.hpp"
+#include "capture.hpp"
+#include "serial.hpp"
+#include "stats.hpp"
+#include "snapshot.hpp"
+#include "recording.hpp"
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
 #include <iostream>
+#include <sstream>
+#include <iomanip>
 #include <algorithm>
-#include <queue>
-#include <unordered_map>
+#include <atomic>
+#ifdef _WIN32
+#include <io.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+
+// One stream of DEBUG output (stdin, a file/FIFO, a serial port or a replay).
+// Each gets its own main terminal and its own namespace of debug windows.
+struct InputSource {
+    std::string label;
+    uint32_t ns;
+    InputPipeline *pipeline;
+    // The main terminal belongs to the main thread like every other window, the input thread
+    // only copies the raw text in here. Nothing's locked, so neither ever waits for the other's
+    // parsing or rendering, only when the main thread is a whole ring behind.
+    SPSCByteRing<4<<20> terminalText;
+    MainTerminalWindow *terminal;
+    uint64_t coalesced = 0, dropped = 0; // Lines the main thread took out of the backlog
+};
 
+static std::vector<InputSource *> sources;
+static std::vector<SDL_Thread *> input_threads;
+static Uint32 input_event; // Posted by the input threads when there is something new
+static std::atomic<bool> input_wakeup_pending;
 
-static std::queue<std::string> input_queue;
-static SDL_mutex *queue_mutex;
-static SDL_Thread *input_thread;
-static MainTerminalWindow *terminalWindow;
-static SDL_mutex *terminal_mutex;
-static std::unordered_map<std::string,std::unique_ptr<DebugWindow>> current_windows;
+static std::vector<SharedWindow> own_windows; // Not in the registry: main terminals and stats
+static StatsWindow *stats_window;
 
+static CaptureWriter *capture;
+static CaptureReader *replay;
+static double replay_speed = 1; // 0 is as fast as possible
 
-static int run_input_thread(void * _) {
-    for(;;) {
-        std::string line;
-        for (;;) {
-            char c;
-            std::cin.get(c);
-            if (c) {
-                SDL_Lock lock (terminal_mutex); // Auto unlocks when it goes out of scope
-                terminalWindow->putChar(c);
-                //std::cout << int(c) << std::endl;
-            }
-            if (c==0 || c == '\n') break;
-            else if (c == '\r') continue;
-            else {
-                line += c;
-            }
-        }
-        if (!line.empty()) {
-            SDL_Lock lock (queue_mutex); // Auto unlocks when it goes out of scope
-            input_queue.push(std::move(line));
-        }
+// A window that gets more lines than this in one go is over budget, and its lines get coalesced
+static constexpr size_t WINDOW_LINE_BUDGET = 64;
+
+// What happens once the main thread can't keep up with an input anymore
+enum class Overload {
+    BLOCK, // Hold up the input until it catches up, nothing gets lost
+    DROP,  // Drop the oldest lines that only draw
+};
+static Overload overload = Overload::BLOCK;
+
+// Everything that comes in goes through here, live or replayed
+static void process_block(InputSource &src, std::string_view block) {
+    // Has to go before framing, that terminates the lines in place
+    for (auto text = block;;) {
+        text.remove_prefix(src.terminalText.write(text.data(),text.size()));
+        if (text.empty()) break;
+        SDL_Delay(1); // Main thread is behind, wait for it
+    }
+    src.pipeline->frame();
+    // Wake up the main loop, unless it hasn't gotten around to the last wakeup yet
+    if (!input_wakeup_pending.exchange(true)) {
+        SDL_Event ev = {.user={.type=input_event}};
+        // Event queue full (or filtered), the next block has to try again
+        if (SDL_PushEvent(&ev) <= 0) input_wakeup_pending = false;
     }
 }
 
-static bool trySetupWindow(const std::string type, std::string args) {
-
-    std::unique_ptr<DebugWindow> *win = nullptr;
-
-    // Check for a name 
-    auto name_end = args.find(' ');
-    if (name_end == std::string::npos) return false;
-    std::string name = args.substr(0,name_end);
-    args = args.substr(name_end+1);
-
-    std::cout << "Trying to setup window of type \"" << type << "\" with name \"" << name << "\"?\n";
-
-    std::string auto_title = name + " - " + type;
-
-    if (current_windows.count(name)) {
-        win = &current_windows[name];
+// Reads what's there without blocking, returns false once the source is done
+static bool read_source(InputSource &src) {
+    auto block = src.pipeline->fill(false);
+    if (block.empty()) {
+        if (!src.pipeline->atEOF()) return true;
+        std::cerr << "Input " << src.label << " closed\n";
+        return false;
     }
+    if (capture) capture->write(block);
+    process_block(src,block);
+    return true;
+}
 
-    if (type == "TERM") {
-        if (!win || typeid(**win)!=typeid(DebugTerminalWindow)) {
-            win = &(current_windows[name]=std::make_unique<DebugTerminalWindow>(std::move(auto_title)));
-        }
+// Blocking reader for a single source
+static int run_input_thread(void *src_ptr) {
+    InputSource &src = *(InputSource *)src_ptr;
+    for(;;) {
+        auto block = src.pipeline->fill();
+        if (block.empty()) break; // EOF
+        if (capture) capture->write(block);
+        process_block(src,block);
     }
-
-    if (win) {
-        std::cout << "parsing setup\n";
-        (*win)->parse_setup(args);
-        return true;
-    } else return false;
-
-    
+    std::cerr << "Input " << src.label << " closed\n";
+    return 0;
 }
 
-
-int main(int argc, char* argv[]) {
-
-    std::cerr << "SDL2 P2 debugger...\n";
-    if (SDL_Init(SDL_INIT_VIDEO)) throw sdl_error("SDL2 init error");
-
-    if (TTF_Init()) throw ttf_error("SDL2_TTF init error");
-
-    // Terminal window is handled directly by the input thread, so don't touch it too much
-    std::cout << "aaaaaaa\n";
-    terminalWindow = new MainTerminalWindow();
-    std::cout << "bbbbbbbb\n";
-
-
-    // Force standard input to be unbuffered (doesn't work for terminal????)
-    std::cin.rdbuf()->pubsetbuf(nullptr,0);
-
-    queue_mutex = SDL_CreateMutex();
-    if (!queue_mutex) throw sdl_error("Failed to create queue lock");
-
-    terminal_mutex = SDL_CreateMutex();
-    if (!terminal_mutex) throw sdl_error("Failed to create terminal lock");
-    
-    input_thread = SDL_CreateThread(run_input_thread,"Data Input",NULL);
-    if (!input_thread) throw sdl_error("Failed to create input thread");
-
-    std::cout << "init ok\n";
-
-    for (;;) {
-        SDL_Event ev;
-        if (SDL_PollEvent(&ev)) {
-            switch(ev.type) {
-                case SDL_QUIT:
-                    std::cout << "Got quit event\n";
-                    goto quit;
-                case SDL_WINDOWEVENT: {
-                    AppWindow *affected_win;
-                    const std::string *affected_name = nullptr;
-                    if (terminalWindow->idMatchesWindow(ev.window.windowID)) {
-                        affected_win = terminalWindow;
-                    } else {
-                        auto find_iter = std::find_if(current_windows.begin(),current_windows.end(),[ev](auto &pair){return pair.second->idMatchesWindow(ev.window.windowID);});
-                        if (find_iter == current_windows.end()) {
-                            std::cout << "Spurious window event?????\n"; // WTF??
-                            break; 
-                        }
-                        affected_win = find_iter->second.get();
-                        affected_name = &find_iter->first;
-                    }
-                    std::cout << "got win event " << int(ev.window.event) << " on " << (affected_name ? *affected_name : "Main window"s) << std::endl;
-                    switch (ev.window.event) {
-                    case SDL_WINDOWEVENT_CLOSE:
-                        if (affected_name) {
-                            // Destroy the window
-                            current_windows.erase(*affected_name);
-                        } else {
-                            // If closing main terminal, just quit
-                            SDL_Event quitEv = {.type=SDL_QUIT};
-                            SDL_PushEvent(&quitEv);
-                        }
-                        break;
-                    default:
-                        affected_win->handleWindowEvent(ev);
-                        break;
-                    }
-                }
-                default: break;
+#ifdef __linux__
+// Serves every source from one thread
+static int run_epoll_thread(void *ep_ptr) {
+    int ep = (int)(intptr_t)ep_ptr;
+    size_t open_count = 0;
+    std::vector<InputSource *> files; // epoll refuses regular files, they're always readable anyways
+    for (auto src : sources) {
+        struct epoll_event ev = {.events=EPOLLIN,.data={.ptr=src}};
+        if (epoll_ctl(ep,EPOLL_CTL_ADD,src->pipeline->getFD(),&ev)) {
+            if (errno != EPERM) {
+                std::cerr << "Can't poll input " << src->label << " (" << strerror(errno) << ")\n";
+                continue;
             }
+            files.push_back(src);
         }
+        open_count++;
+    }
 
-        std::queue<std::string> dispatch_queue;
-        {
-            SDL_Lock lock (queue_mutex); // Auto unlocks when it goes out of scope
-            while (!input_queue.empty()) {
-                std::string &line = input_queue.front();
-                if (line[0] == '`') dispatch_queue.push(std::move(line)); // Dispatch this later (when the input is unlocked again)
-                //std::cout << input_queue.front() << std::endl;
-                input_queue.pop();
-            }
+    std::array<struct epoll_event,16> events;
+    while (open_count) {
+        // Don't sleep while there's file data to get through
+        int n = epoll_wait(ep,events.data(),events.size(),files.empty() ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "epoll_wait failed (" << strerror(errno) << ")\n";
+            break;
         }
-        while (!dispatch_queue.empty()) {
-            std::string line = std::move(dispatch_queue.front());
-            dispatch_queue.pop();
-
-            auto ident_end = line.find(' ',1);
-            if (ident_end == std::string::npos) continue;
-            std::string ident = line.substr(1,ident_end-1);
-            if (current_windows.count(ident)) {
-                // Dispatch to window
-                current_windows[ident]->parse_data(line.substr(ident_end+1));
-            } else if (trySetupWindow(ident,line.substr(ident_end+1))) {
-                
+        for (int i=0;i<n;i++) {
+            auto src = (InputSource *)events[i].data.ptr;
+            if (!read_source(*src)) {
+                epoll_ctl(ep,EPOLL_CTL_DEL,src->pipeline->getFD(),nullptr);
+                open_count--;
             }
-
-
         }
-
-        // Update dirty windows
-        for (auto iter=current_windows.begin();iter!=current_windows.end();) {
-            auto &name = iter->first;
-            auto &win = iter->second;
-            if (win->shouldClose) {
-                iter = current_windows.erase(iter);
+        for (auto iter = files.begin();iter != files.end();) {
+            if (read_source(**iter)) {
+                iter++;
             } else {
-                if(win->shouldRepaint()) {
-                    win->repaint();
-                }
-                ++iter;
+                iter = files.erase(iter);
+                open_count--;
             }
         }
-
-        // Update main terminal
-        if (terminalWindow->shouldRepaint()) {
-            SDL_Lock lock (terminal_mutex); // Auto unlocks when it goes out of scope
-            terminalWindow->repaint();
+    }
+    close(ep);
+    return 0;
+}
+#endif
+
+static int run_replay_thread(void *src_ptr) {
+    InputSource &src = *(InputSource *)src_ptr;
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    CaptureReader::Record rec;
+    while (replay->next(rec)) {
+        if (replay_speed > 0) {
+            // Wait for the (scaled) arrival time of this record
+            for (;;) {
+                double elapsed_us = double(SDL_GetPerformanceCounter()-start)*1000000/freq;
+                double wait_us = rec.time_us/replay_speed - elapsed_us;
+                if (wait_us <= 0) break;
+                SDL_Delay(std::max(1,int(wait_us/1000)));
+            }
         }
+        auto data = rec.data;
+        while (!data.empty()) {
+            auto block = src.pipeline->fill(data.data(),data.size());
+            data.remove_prefix(block.size());
+            process_block(src,block);
+        }
+    }
+    std::cerr << "Replay done\n";
+    return 0;
+}
 
-        SDL_Delay(16);
+static InputSource *findTerminal(uint32_t winID) {
+    for (auto src : sources) {
+        if (src->terminal->idMatchesWindow(winID)) return src;
     }
+    return nullptr;
+}
 
-    quit:
+struct StatsSample {
+    Uint64 time;
+    uint64_t bytes, lines, dispatched;
+};
 
-    delete terminalWindow;
-    terminalWindow = nullptr;
+static StatsSample stats_sample() {
+    StatsSample sample = {.time=SDL_GetPerformanceCounter(),.bytes=0,.lines=0,.dispatched=perf_stats.linesDispatched};
+    for (auto src : sources) {
+        sample.bytes += src->pipeline->bytesRead();
+        sample.lines += src->pipeline->linesRead();
+    }
+    return sample;
+}
 
-    SDL_Quit();
-    return 0;
+// Totals, plus rates since the given sample
+static std::string stats_report(const StatsSample &since) {
+    StatsSample now = stats_sample();
+    double secs = std::max(1e-6,double(now.time-since.time)/SDL_GetPerformanceFrequency());
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    for (auto src : sources) {
+        out << src->label << ": " << src->pipeline->bytesRead()/1024 << " KiB, " << src->pipeline->linesRead() << " lines, queue " << src->pipeline->pending()
+            << ", text " << src->terminalText.size()/1024 << " KiB\n";
+        if (src->coalesced || src->dropped) out << "  coalesced " << src->coalesced << ", dropped " << src->dropped << "\n";
+    }
+    out << "In: " << (now.bytes-since.bytes)/1024.0/secs << " KiB/s, " << (now.lines-since.lines)/secs << " lines/s\n";
+    out << "Dispatched: " << perf_stats.linesDispatched << " (" << (now.dispatched-since.dispatched)/secs << "/s)";
+    if (perf_stats.linesDispatched) out << ", parse " << ticks_to_ms(perf_stats.parseTicks)*1000/perf_stats.linesDispatched << " us/line";
+    out << "\n";
+    out << "Repaint: " << perf_stats.frames << " frames";
+    if (perf_stats.frames) out << ", avg " << ticks_to_ms(perf_stats.repaintTicks)/perf_stats.frames << " ms, max " << ticks_to_ms(perf_stats.repaintMaxTicks) << " ms";
+    out << "\n";
+    out << "Rendered: " << perf_stats.windowsRendered << " windows, " << perf_stats.cellsRendered.load(std::memory_order_relaxed) << " cells, "
+        << perf_stats.cellsSkipped.load(std::memory_order_relaxed) << " unchanged\n";
+    uint64_t hits, misses;
+    font_cache.getAtlasStats(hits,misses);
+    out << "Glyphs: " << hits << " hits, " << misses << " misses";
+    if (hits+misses) out << " (" << 100.0*hits/(hits+misses) << "% hit)";
+    out << ", " << font_cache.size() << " font sizes";
+    out << "\n";
+    for (auto &[key,entry] : current_windows) {
+        out << "  ";
+        if (sources.size() > 1) out << sources[entry->ns]->label << ": ";
+        out << entry->name << ": " << entry->win->linesIn << " lines\n";
+    }
+    return out.str();
 }
 
+static void toggle_stats() {
+    if (stats_window) {
+        own_windows.erase(std::remove_if(own_windows.begin(),own_windows.end(),[](auto &w) {return w.win == stats_window;}),own_windows.end());
+        delete stats_window;
+        stats_window = nullptr;
+    } else {
+        stats_window = new StatsWindow();
+        own_windows.push_back({.win=stats_window,.lock=nullptr});
+    }
+}
 
-AppWindow::AppWindow() {
-    // Nothing to do here for now...
+// Returns false when it's time to quit
+static bool handleEvent(SDL_Event &ev) {
+    switch(ev.type) {
+        case SDL_QUIT:
+            std::cout << "Got quit event\n";
+            return false;
+        case SDL_WINDOWEVENT: {
+            if (stats_window && stats_window->idMatchesWindow(ev.window.windowID)) {
+                if (ev.window.event == SDL_WINDOWEVENT_CLOSE) toggle_stats();
+                break;
+            }
+            AppWindow *affected_win;
+            std::string_view affected_name;
+            uint32_t affected_ns = 0;
+            InputSource *affected_src = findTerminal(ev.window.windowID);
+            if (affected_src) {
+                affected_win = affected_src->terminal;
+            } else {
+                affected_win = current_windows.findByID(ev.window.windowID,&affected_name,&affected_ns);
+                if (!affected_win) {
+                    std::cout << "Spurious window event?????\n"; // WTF??
+                    break; 
+                }
+            }
+            std::cout << "got win event " << int(ev.window.event) << " on " << (!affected_name.empty() ? affected_name : "Main window"sv) << std::endl;
+            switch (ev.window.event) {
+            case SDL_WINDOWEVENT_CLOSE:
+                if (!affected_name.empty()) {
+                    // Destroy the window
+                    current_windows.erase(affected_name,affected_ns);
+                } else {
+                    // If closing a main terminal, just quit
+                    SDL_Event quitEv = {.type=SDL_QUIT};
+                    SDL_PushEvent(&quitEv);
+                }
+                break;
+            default:
+                affected_win->handleWindowEvent(ev);
+                break;
+            }
+        } break;
+        case SDL_KEYDOWN:
+        case SDL_MOUSEWHEEL: {
+            uint32_t winID = ev.type == SDL_KEYDOWN ? ev.key.windowID : ev.wheel.windowID;
+            if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F12) {
+                toggle_stats();
+            } else if (InputSource *src = findTerminal(winID)) {
+                src->terminal->handleInputEvent(ev);
+            } else if (AppWindow *win = current_windows.findByID(winID)) {
+                win->handleInputEvent(ev);
+            }
+        } break;
+        default:
+            if (ev.type == input_event) input_wakeup_pending = false;
+            break;
+    }
+    return true;
 }
 
-void AppWindow::repaint() {
-    // Just make sure the window is set up
-    const char *title = get_title();
-    if (!handle) {
-        std::cout << "Window size: " << dim.width << ", " << dim.height << std::endl;
-        handle = SDL_CreateWindow(title,SDL_WINDOWPOS_UNDEFINED,SDL_WINDOWPOS_UNDEFINED,dim.width,dim.height,getWindowFlags());
-        if (!handle) throw sdl_error("Failed to create window \""s + title + "\"");
+static bool inputPending() {
+    for (auto src : sources) {
+        if (src->pipeline->pending() || src->terminalText.size()) return true;
     }
-    if (!strcmp(SDL_GetWindowTitle(handle),title)) SDL_SetWindowTitle(handle,title);
-    int w,h;
-    SDL_GetWindowSize(handle,&w,&h);
-    if (w != dim.width || h != dim.height) SDL_SetWindowSize(handle,dim.width,dim.height);
+    return false;
+}
 
-    dirty = false;
-    forceRepaint = false;
+// Takes lines out of a backlog before it's dispatched, so the windows don't fall further behind.
+// Coalescing always comes out the same, dropping only happens if asked for.
+static void thin_backlog(InputSource &src, std::vector<std::string_view> &lines) {
+    if (lines.size() <= WINDOW_LINE_BUDGET) return; // No window can be over budget
+    size_t taken = coalesce_lines(lines,WINDOW_LINE_BUDGET,src.ns);
+    src.coalesced += taken;
+    size_t left = lines.size()-taken;
+    // Still more than half a queue behind, get back down to a quarter
+    if (overload == Overload::DROP && left > InputPipeline::capacity()/2) {
+        src.dropped += drop_lines(lines,left-InputPipeline::capacity()/4,src.ns);
+    }
+}
+
+// Catches the main terminal up with what the input thread copied over
+static void feed_terminal(InputSource &src) {
+    // Only what's there now, like the lines
+    for (size_t left = src.terminalText.size();left;) {
+        auto text = src.terminalText.peek();
+        text = text.substr(0,std::min(text.size(),left));
+        left -= text.size();
+        src.terminalText.consume(text.size());
+        // NULs only end lines, they don't clear the main terminal
+        while (!text.empty()) {
+            auto len = std::min(text.find('\0'),text.size());
+            src.terminal->putString(text.substr(0,len));
+            text.remove_prefix(std::min(len+1,text.size()));
+        }
+    }
+}
+
+static bool repaintPending() {
+    for (auto &own : own_windows) {
+        if (own.win->shouldRepaint()) return true;
+    }
+    for (auto &[name,entry] : current_windows) {
+        if (entry->win->shouldClose || entry->win->shouldRepaint()) return true;
+    }
+    return false;
 }
 
-AppWindow::~AppWindow() {
-    if (handle) SDL_DestroyWindow(handle);
+static Uint32 getFrameInterval() {
+    SDL_DisplayMode mode;
+    if (SDL_GetCurrentDisplayMode(0,&mode) || mode.refresh_rate <= 0) return 1000/60;
+    return std::max(1000/mode.refresh_rate,1);
 }
 
-token_iterator token_iterator::begin(const std::string &str) {
-    token_iterator i = {std::string_view(str.c_str(),0)};
-    return ++i;
+static int open_input_file(const std::string &path) {
+    if (path == "-") return 0; // stdin
+    #ifdef _WIN32
+    int fd = open(path.c_str(),O_RDONLY|O_BINARY);
+    #else
+    int fd = open(path.c_str(),O_RDONLY); // Blocks on a FIFO until something opens the other end
+    #endif
+    if (fd < 0) throw std::runtime_error("Can't open input "+path+" ("+strerror(errno)+")");
+    return fd;
 }
-token_iterator token_iterator::end(const std::string &str) {
-    return {std::string_view(str.c_str()+str.size(),0)};
+
+static void add_source(std::string label, InputPipeline *pipeline) {
+    auto src = new InputSource{.label=std::move(label),.ns=uint32_t(sources.size()),.pipeline=pipeline};
+    sources.push_back(src);
 }
 
-token_iterator& token_iterator::operator++() {
+int main(int argc, char* argv[]) {
 
-    const char *start = view.data()+view.size();
-    // Advance past spaces
-    while (*start == ' ') start++;
+    std::cerr << "SDL2 P2 debugger...\n";
 
-    if (*start == 0) {
-        view = std::string_view(start,0);
-        return *this;
+    struct SourceArg {
+        bool port;
+        std::string path;
+        int baud;
+    };
+    std::vector<SourceArg> source_args;
+    size_t scrollback_limit = Scrollback::DEFAULT_LIMIT;
+    const char *record_path = nullptr, *replay_path = nullptr;
+    int baud = default_baud;
+    bool show_stats = false;
+    for (int i=1;i<argc;i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--scrollback" && i+1<argc) {
+            scrollback_limit = size_t(std::max(0,atoi(argv[++i])))*1024*1024;
+        } else if (arg == "--record" && i+1<argc) {
+            record_path = argv[++i];
+        } else if (arg == "--replay" && i+1<argc) {
+            replay_path = argv[++i];
+        } else if (arg == "--port" && i+1<argc) {
+            // DEVICE or DEVICE@BAUD
+            std::string path = argv[++i];
+            auto at = path.rfind('@');
+            int port_baud = 0;
+            if (at != std::string::npos && at+1 < path.size()) {
+                port_baud = atoi(path.c_str()+at+1);
+                path.resize(at);
+            }
+            source_args.push_back({.port=true,.path=path,.baud=port_baud});
+        } else if (arg == "--input" && i+1<argc) {
+            source_args.push_back({.port=false,.path=argv[++i]});
+        } else if (arg == "--baud" && i+1<argc) {
+            baud = atoi(argv[++i]);
+        } else if (arg == "--speed" && i+1<argc) {
+            replay_speed = std::max(0.0,atof(argv[++i]));
+        } else if (arg == "--stats") {
+            show_stats = true;
+        } else if (arg == "--overload" && i+1<argc && (argv[i+1] == "block"sv || argv[i+1] == "drop"sv)) {
+            overload = argv[++i] == "drop"sv ? Overload::DROP : Overload::BLOCK;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--scrollback MiB] [--port DEVICE[@BAUD]]... [--input FILE]... [--baud N] [--record FILE | --replay FILE [--speed N]] [--stats] [--overload block|drop]\n";
+            std::cerr << "  Reads stdin unless an input or port is given, --input - is stdin\n";
+            std::cerr << "  Every input gets its own main terminal and windows, --baud defaults to " << default_baud << "\n";
+            std::cerr << "  --speed 0 replays as fast as possible\n";
+            std::cerr << "  --stats opens the STATS window right away, F12 toggles it\n";
+            std::cerr << "  --overload drop drops the oldest drawing lines once the windows fall behind, setup lines and commands always go through\n";
+            return 1;
+        }
+    }
+    if (record_path && source_args.size() > 1) {
+        std::cerr << "Can only record a single input\n";
+        return 1;
     }
-    const char *end = start;
-    bool is_string = *start == '\'';
-    while (*end != 0 && (start == end || *end != (is_string?'\'':' '))) end++;
-    if (is_string) end++;
 
-    view = std::string_view(start,end-start);
+    if (SDL_Init(SDL_INIT_VIDEO)) throw sdl_error("SDL2 init error");
 
-    return *this;
-};
+    if (TTF_Init()) throw ttf_error("SDL2_TTF init error");
 
-token_iterator::token_kind token_iterator::classify() const {
-    char c = view.front();
-    if (view.size() == 0) {
-        switch (c) {
-        case 0: return TOKEN_END;
-        default: return TOKEN_ERROR;
-        }
+    if (replay_path) {
+        replay = new CaptureReader(replay_path);
+        add_source(replay_path,new InputPipeline(-1));
+    } else if (source_args.empty()) {
+        add_source("stdin",new InputPipeline(0));
     } else {
-        switch (c) {
-        case 0: return TOKEN_ERROR;
-        case '\'': return TOKEN_STRING;
-        case 'a' ... 'z': case 'A' ... 'Z': return TOKEN_SYMBOL;
-        case '0' ... '9': case '-': case '+': return TOKEN_NUMBER;
-        default: return TOKEN_ERROR;
+        for (auto &arg : source_args) {
+            int fd = arg.port ? open_serial_port(arg.path,arg.baud ? arg.baud : baud) : open_input_file(arg.path);
+            add_source(arg.path == "-" ? "stdin" : arg.path,new InputPipeline(fd));
         }
     }
-}
+    if (record_path && !replay) capture = new CaptureWriter(record_path);
 
-token_iterator::value_type token_iterator::get_symbol(const std::string& desc) {
-    expect(TOKEN_SYMBOL,desc);
-    value_type sview = view;
-    (*this)++;
-    return sview;
-}
+    for (auto src : sources) {
+        std::string title = "DEBUG Output";
+        if (sources.size() > 1) title += " - " + src->label;
+        src->terminal = new MainTerminalWindow(title);
+        src->terminal->setScrollbackLimit(scrollback_limit);
+    }
 
-token_iterator::value_type token_iterator::get_string(const std::string& desc) {
-    expect(TOKEN_STRING,desc);
-    value_type sview = view;
-    sview.remove_prefix(1); // Get rid of quotes
-    sview.remove_suffix(1);
-    (*this)++;
-    return sview;
-}
+    for (auto src : sources) own_windows.push_back({.win=src->terminal,.lock=nullptr});
+    if (show_stats) toggle_stats();
 
-// This is slightly painful
-int token_iterator::get_int(const std::string& desc) {
-    expect(TOKEN_NUMBER,desc);
-    value_type pview = view;
-    bool negative = false;
-    int val = 0;
-    switch(pview.front()) {
-    case '-':
-        negative = true;
-        // fall through
-    case '+':
-        pview.remove_prefix(1);
-        break;
+    input_event = SDL_RegisterEvents(1);
+    if (input_event == Uint32(-1)) throw sdl_error("Failed to register input event");
+
+    if (replay) {
+        input_threads.push_back(SDL_CreateThread(run_replay_thread,"Data Input",sources[0]));
+    } else {
+        bool multiplexed = false;
+        #ifdef __linux__
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        if (ep >= 0) {
+            input_threads.push_back(SDL_CreateThread(run_epoll_thread,"Data Input",(void *)(intptr_t)ep));
+            multiplexed = true;
+        }
+        #endif
+        // No epoll, one blocking reader per source
+        if (!multiplexed) {
+            for (auto src : sources) input_threads.push_back(SDL_CreateThread(run_input_thread,"Data Input",src));
+        }
     }
-    for (char c : pview) {
-        if (c=='_') continue;
-        if (c < '0' || c > '9') throw token_error("Bad char "+std::to_string(int(c))+"in integer!");
-        val = val*10 + c - '0';
+    for (auto thread : input_threads) {
+        if (!thread) throw sdl_error("Failed to create input thread");
     }
-    (*this)++;
-    return negative ? -val : +val;
-}
 
+    std::cout << "init ok\n";
 
-bool token_iterator::is_color(const std::string& desc) const {
-    switch (classify()) {
-    case TOKEN_NUMBER:  return true; // Presume this is an RGB color
-    case TOKEN_SYMBOL: {
-        auto symbol = **this;
-        if (casecompare(symbol,"WHITE")) return true;
-        else if (casecompare(symbol,"BLACK")) return true;
-        else if (casecompare(symbol,"GREY")) return true;
-        else if (casecompare(symbol,"YELLOW")) return true;
-        else if (casecompare(symbol,"MAGENTA")) return true;
-        else if (casecompare(symbol,"RED")) return true;
-        else if (casecompare(symbol,"CYAN")) return true;
-        else if (casecompare(symbol,"GREEN")) return true;
-        else if (casecompare(symbol,"BLUE")) return true;
-        else if (casecompare(symbol,"ORANGE")) return true;
-        else return false;
-    }
-    default: return false;
-    }
-}
+    Uint32 frame_interval = getFrameInterval();
+    Uint32 last_frame = SDL_GetTicks() - frame_interval;
+    StatsSample start_sample = stats_sample(), last_sample = start_sample;
 
+    for (;;) {
+        // Sleep until something happens or the next frame is due
+        int timeout = -1;
+        if (inputPending()) timeout = 0;
+        else if (repaintPending()) timeout = std::max(0,int(last_frame + frame_interval - SDL_GetTicks()));
+        if (stats_window) {
+            // Refresh once a second
+            int until_stats = std::max(0,1000-int((SDL_GetPerformanceCounter()-last_sample.time)*1000/SDL_GetPerformanceFrequency()));
+            timeout = timeout < 0 ? until_stats : std::min(timeout,until_stats);
+            if (until_stats == 0) {
+                stats_window->show(stats_report(last_sample));
+                last_sample = stats_sample();
+            }
+        }
 
-SDL_Color token_iterator::get_color(const std::string& desc) {
-    switch (classify()) {
-    case TOKEN_NUMBER: {// Presume this is an RGB color
-        int c = get_int();
-        return {.r=c&255,.g=(c>>8)&255,.b=(c>>16)&255};
-    } break;
-    case TOKEN_SYMBOL: {
-        auto symbol = get_symbol();
-        SDL_Color basecol;
-        bool need_intensity = true;
-        if (casecompare(symbol,"WHITE")) {
-            basecol = {255,255,255};
-            need_intensity = false;
-        } else if (casecompare(symbol,"BLACK")) {
-            basecol = {0,0,0};
-            need_intensity = false;
-        } 
-        else if (casecompare(symbol,"GREY")) basecol = {255,255,255};
-        else if (casecompare(symbol,"YELLOW")) basecol = {255,255,0};
-        else if (casecompare(symbol,"MAGENTA")) basecol = {255,0,255};
-        else if (casecompare(symbol,"RED")) basecol = {255,0,0};
-        else if (casecompare(symbol,"CYAN")) basecol = {0,255,255};
-        else if (casecompare(symbol,"GREEN")) basecol = {0,255,0};
-        else if (casecompare(symbol,"BLUE")) basecol = {0,0,255};
-        else if (casecompare(symbol,"ORANGE")) basecol = {255,127,0};
-        else {
-            throw token_error("Unknown color \""s+std::string(symbol)+"\"");
+        SDL_Event ev;
+        if (timeout < 0 ? SDL_WaitEvent(&ev) : SDL_WaitEventTimeout(&ev,timeout)) {
+            if (!handleEvent(ev)) goto quit;
+            while (SDL_PollEvent(&ev)) {
+                if (!handleEvent(ev)) goto quit;
+            }
         }
-        if (need_intensity) {
-            short i = classify() == TOKEN_NUMBER ? std::clamp(get_int(),0,15) : 8;
-            short lighten = (i-8)<<5;
-            if (lighten>0) return {std::min(255,basecol.r+lighten),std::min(255,basecol.g+lighten),std::min(255,basecol.b+lighten)};
-            else return {(basecol.r*i)>>3,(basecol.g*i)>>3,(basecol.b*i)>>3};
-        } else return basecol;
-    }
-    default:
-        throw token_error("While "+desc+": Expected NUMBER or SYMBOL");
-    }
-}
 
-bool DebugWindow::try_parse_common_setup_sym(std::string_view symbol, token_iterator &iter) {
-    if (casecompare(symbol,"POS")) {
-        int x = iter.get_int("Getting POS X");
-        int y = iter.get_int("Getting POS Y");
-        // TODO: actually handle this
-    } else if (casecompare(symbol,"TITLE")) {
-        title = iter.get_string("Getting TITLE");
-        dirty = true;
-    } else if (casecompare(symbol,"UPDATE")) {
-        lazyRepaint = true;
-    } else {
-        return false;
-    }
+        // Only take what's there now, so a flood of input can't starve the repaint
+        for (auto src : sources) {
+            feed_terminal(*src);
+            // Only put the source in the titles if there's more than one
+            std::string_view label = sources.size() > 1 ? std::string_view(src->label) : std::string_view();
+            static std::vector<InputLine> batch;
+            static std::vector<std::string_view> texts;
+            batch.clear();
+            texts.clear();
+            InputLine line;
+            for (size_t n = src->pipeline->pending(); n && src->pipeline->pop(line); n--) {
+                batch.push_back(line);
+                texts.push_back(line.text);
+            }
+            thin_backlog(*src,texts);
+            for (size_t i=0;i<batch.size();i++) {
+                if (!texts[i].empty()) dispatch_line(texts[i],src->ns,label);
+                src->pipeline->release(batch[i]);
+            }
+        }
 
-    return true;
-}
+        // Paint at most once per display frame
+        if (SDL_GetTicks() - last_frame < frame_interval) continue;
+        last_frame = SDL_GetTicks();
 
-bool DebugWindow::try_parse_common_data_sym(std::string_view symbol, token_iterator &iter) {
-    if (casecompare(symbol,"CLOSE")) {
-        shouldClose = true;
-    } else if (casecompare(symbol,"UPDATE")) {
-        forceRepaint = true;
-    } else if (casecompare(symbol,"SAVE")) {
-        repaint(); // Force repaint
-        bool window = iter.classify()==token_iterator::TOKEN_SYMBOL && casecompare(*iter,"WINDOW") && (++iter,true);
-        auto name = iter.get_string("Getting SAVE file name");
-        auto surface = get_save_surface();
-        if (name[0] == '/') throw std::runtime_error("SAVE Path mustn't be absolute");
-        if (name.find("..")!=name.npos) throw std::runtime_error("SAVE Path mustn't contain \"..\"");
-        SDL_SaveBMP(surface,(std::string(name)+".bmp").c_str());
-        dispose_save_surface(surface);
-    } else {
-        return false;
+        // Update dirty windows, main terminals included
+        repaint_windows(own_windows);
     }
 
-    return true;
-}
+    quit:
 
-SDL_Surface *DebugWindow::get_save_surface() {
-    auto surf = SDL_GetWindowSurface(handle);
-    if (!surf) throw sdl_error("Failed to get window surface for screenshot");
-    if (SDL_LockSurface(surf)) throw sdl_error("Failed to get window surface for screenshot");;
-    return surf;
-}
+    std::cerr << stats_report(start_sample);
+    // Don't lose the last SAVEs and recorded frames
+    snapshot_writer.flush();
+    recording_writer.flush();
+    if (stats_window) toggle_stats();
+    for (auto src : sources) {
+        delete src->terminal;
+        src->terminal = nullptr;
+    }
+    current_windows = WindowRegistry(); // Closes the debug windows (and their fonts) while SDL is still up
 
-void DebugWindow::dispose_save_surface(SDL_Surface *surf) {
-    SDL_UnlockSurface(surf);
+    SDL_Quit();
+    return 0;
 }
-
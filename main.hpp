@@ -5,12 +5,23 @@
 #include <memory>
 #include <string>
 #include <cstring>
+#include <unordered_map>
+#include <vector>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 
 using uint = unsigned;
 
+// Chatter for every token/symbol parsed, compiled out of release builds (rake RELEASE=1)
+#ifdef NDEBUG
+#define DEBUG_TRACE(x) do {} while (0)
+#else
+#include <iostream>
+#define DEBUG_TRACE(x) do {std::cout << x;} while (0)
+#endif
+
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
 struct Dimension {
     int width,height;
@@ -52,44 +63,73 @@ class token_iterator {
         class token_expected : public token_error {
             public:
                 token_expected(token_iterator iter,token_kind expect, const std::string& desc = "")
-                : token_error((desc.empty()?desc:desc+". ")+"Expected "+token_kind_names[expect]+", got "+token_kind_names[iter.classify()]+(iter.classify()>TOKEN_ERROR?" ("+std::string(*iter)+")":""))
+                : token_error((desc.empty()?desc:desc+". ")+"Expected "+token_kind_names[expect]+", got "+token_kind_names[iter.classify()]+(!iter->empty()?" ("+std::string(*iter)+")":""))
                 {};
         };
 
+        // Classified (and for numbers, decoded) once when the line is scanned
+        struct token {
+            std::string_view text; // Strings keep their quotes
+            token_kind kind;
+            int value; // Numbers only
+        };
+
         using iterator_category = std::forward_iterator_tag;
         using difference_type = std::ptrdiff_t;
         using value_type = std::string_view;
         using pointer = const value_type *;
         using reference = const value_type &;
 
-        reference operator*() const {return view;};
-        pointer operator->() {return &view;};
+        reference operator*() const {return tok->text;};
+        pointer operator->() const {return &tok->text;};
 
-        token_iterator& operator++();
+        // Stays put on the END token
+        token_iterator& operator++() {if (tok->kind != TOKEN_END) tok++; return *this;};
         token_iterator operator++(int) { auto tmp = *this; ++(*this); return tmp; }
 
-        static token_iterator begin(const std::string &str);
-        static token_iterator end(const std::string &str);
-
-        token_kind classify() const;
-        void expect(token_kind kind, const std::string& desc = "") const {
+        token_kind classify() const {return tok->kind;};
+        void expect(token_kind kind, const char *desc = "") const {
             token_kind got = classify();
             if (got!=kind) throw token_expected(*this,kind,desc);
         };
 
-        value_type get_string(const std::string& desc = "");
-        int get_int(const std::string& desc = "");
-        value_type get_symbol(const std::string& desc = "");
+        value_type get_string(const char *desc = "");
+        int get_int(const char *desc = "") {
+            expect(TOKEN_NUMBER,desc);
+            int val = tok->value; // Already decoded by the scan
+            ++(*this);
+            return val;
+        };
+        value_type get_symbol(const char *desc = "");
 
-        bool is_color(const std::string& desc = "") const;
-        SDL_Color get_color(const std::string& desc = "");
+        bool is_color(const char *desc = "") const;
+        SDL_Color get_color(const char *desc = "");
 
-        friend bool operator== (const token_iterator &a, const token_iterator &b) {return same_view(a.view,b.view);};
-        friend bool operator!= (const token_iterator &a, const token_iterator &b) {return !same_view(a.view,b.view);};
+        friend bool operator== (const token_iterator &a, const token_iterator &b) {return a.tok == b.tok;};
+        friend bool operator!= (const token_iterator &a, const token_iterator &b) {return a.tok != b.tok;};
 
     private:
-        std::string_view view;
-        token_iterator(std::string_view v) : view{v} {};
+        const token *tok;
+        token_iterator(const token *t) : tok{t} {};
+        friend class token_line;
+};
+
+// A debug line split into tokens in one pass, ending with an END token.
+// Numbers can be decimal, $hex, %binary or %%quaternary, with _ anywhere in the digits.
+// Keep one around and scan line after line into it, so the array doesn't get reallocated.
+class token_line {
+    private:
+        std::vector<token_iterator::token> tokens;
+        std::vector<uint64_t> spaceBits; // One bit per byte of the line
+        std::vector<uint32_t> bounds; // Where tokens start and end
+        void markSpaces(std::string_view str);
+        size_t findBit(size_t pos, bool space) const;
+    public:
+        token_line() {scan({});};
+        void scan(std::string_view str);
+        token_iterator begin() const {return {tokens.data()};};
+        token_iterator end() const {return {&tokens.back()};};
+        size_t size() const {return tokens.size()-1;};
 };
 
 
@@ -101,18 +141,30 @@ class AppWindow {
         bool idMatchesWindow(uint32_t winID) {
             return SDL_GetWindowID(handle) == winID;
         };
+        uint32_t getWindowID() {return handle ? SDL_GetWindowID(handle) : 0;};
         bool shouldClose = false;
 
 
         AppWindow();
         virtual ~AppWindow();
-        virtual void repaint();
+        // Repainting is split up so the rendering can happen on a worker thread:
+        // prepare and present touch the SDL window, so only from the main thread,
+        // render just draws into the canvas, so any thread (but one at a time per window).
+        virtual bool prepare(); // True if the canvas is new, so everything needs drawing
+        virtual void render() {};
+        virtual void present();
+        void repaint() {prepare(); render(); present();};
         virtual bool handleWindowEvent(SDL_Event &ev) {return false;};
+        virtual bool handleInputEvent(SDL_Event &ev) {return false;}; // Keyboard/mouse
 
         bool shouldRepaint() {return (dirty && !lazyRepaint) || forceRepaint;};
 
     protected:
         SDL_Window *handle = nullptr;
+        SDL_Surface *canvas = nullptr; // Off-screen copy of the window contents, always 32 bit
+        SDL_Surface *presentedSurface = nullptr; // The window surface last presented to
+        std::vector<SDL_Rect> presentRects; // Set by render, areas of the canvas that changed
+        bool presentAll = true;
         bool dirty = true;
         bool forceRepaint = true;
         bool lazyRepaint = false;
@@ -122,32 +174,95 @@ class AppWindow {
         }
 };
 
+class WindowRecorder;
+
+// What a data line would do to its window, worked out without running it.
+// Lets lines be coalesced under overload (see coalesce_lines), the defaults never are.
+struct LineEffect {
+    bool known = false;       // Only plain drawing, no commands
+    bool settled = false;     // Doesn't leave the window waiting for an argument
+    bool keepsColors = false; // Doesn't select colors
+    bool wipes = false;       // Clears the window first, nothing from before shows through
+    bool placed = false;      // Starts at home, picks its colors before drawing and never scrolls
+    std::string shape;        // Cursor moves of a placed line, equal shapes cover exactly the same cells
+};
+
 class DebugWindow : public virtual AppWindow {
     public:
-        virtual void parse_setup(const std::string &str) = 0;
-        virtual void parse_data(const std::string &str) = 0;
+        virtual void parse_setup(std::string_view str) = 0;
+        virtual void parse_data(std::string_view str) = 0;
+        virtual LineEffect data_effect(std::string_view str) {return {};};
+        virtual bool data_settled() {return false;}; // Not waiting for the rest of a sequence from the next line
         virtual const char *get_title() {return title.c_str();};
-        DebugWindow(std::string title) : AppWindow(), title{title} {};
+        virtual void present();
+        DebugWindow(std::string title);
+        virtual ~DebugWindow();
+        uint64_t linesIn = 0; // For the stats
     protected:
         std::string title;
+        std::unique_ptr<WindowRecorder> recorder; // Between RECORD and STOP
+        token_line tokens; // Of the line being parsed
 
-        virtual SDL_Surface *get_save_surface();
+        virtual SDL_Surface *get_save_surface(bool window);
         virtual void dispose_save_surface(SDL_Surface *surf);
         
         bool try_parse_common_setup_sym(std::string_view symbol, token_iterator &iter);
         bool try_parse_common_data_sym(std::string_view symbol, token_iterator &iter);
 };
 
-// For C++ RAII magic
+// Owns all the named debug windows.
+// Names are interned in the entries, so lookups can go by string_view.
+// Every input source gets its own namespace, so equal names don't collide.
+class WindowRegistry {
+    private:
+        struct Entry {
+            std::string name;
+            uint32_t ns;
+            std::unique_ptr<DebugWindow> win;
+            uint32_t id = 0; // SDL window ID, once the window exists
+        };
+        struct Key {
+            uint32_t ns;
+            std::string_view name;
+            bool operator==(const Key &that) const {return ns == that.ns && name == that.name;};
+        };
+        struct KeyHash {
+            size_t operator()(const Key &key) const {
+                return std::hash<std::string_view>{}(key.name) ^ (size_t(key.ns)*0x9E3779B97F4A7C15ull);
+            };
+        };
+        using name_map = std::unordered_map<Key,std::unique_ptr<Entry>,KeyHash>;
+        name_map byName; // Keys point into Entry::name
+        std::unordered_map<uint32_t,Entry *> byID;
+
+        Entry *indexByID(uint32_t id);
+    public:
+        using iterator = name_map::iterator;
+
+        DebugWindow *find(std::string_view name, uint32_t ns = 0) {
+            auto iter = byName.find({ns,name});
+            return iter == byName.end() ? nullptr : iter->second->win.get();
+        };
+        DebugWindow *findByID(uint32_t id, std::string_view *name = nullptr, uint32_t *ns = nullptr);
+        DebugWindow *insert(std::string_view name, std::unique_ptr<DebugWindow> win, uint32_t ns = 0);
+        void erase(std::string_view name, uint32_t ns = 0);
+        iterator erase(iterator iter);
+
+        iterator begin() {return byName.begin();};
+        iterator end() {return byName.end();};
+        size_t size() const {return byName.size();};
+};
+
+// For C++ RAII magic, a null mutex is just not locked
 class SDL_Lock {
     private:
         SDL_mutex *m;
     public:
         SDL_Lock(SDL_mutex *mutex) : m{mutex} {
-            SDL_LockMutex(m);
+            if (m) SDL_LockMutex(m);
         };
         ~SDL_Lock() {
-            SDL_UnlockMutex(m);
+            if (m) SDL_UnlockMutex(m);
         };
         SDL_Lock(const SDL_Lock &) = delete;
         SDL_Lock &operator=(const SDL_Lock &) = delete;
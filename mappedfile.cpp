@@ -0,0 +1,63 @@
+#include "mappedfile.hpp"
+#include <cerrno>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string &path, bool sequential) {
+    #ifdef _WIN32
+    file = CreateFileA(path.c_str(),GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS,NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = nullptr;
+        throw std::runtime_error("Can't open "+path);
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(file,&size);
+    length = size.QuadPart;
+    if (length) {
+        mapping = CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+        if (!mapping || !(base = (const uint8_t *)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0))) {
+            unmap();
+            throw std::runtime_error("Can't map "+path);
+        }
+    }
+    #else
+    int fd = open(path.c_str(),O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Can't open "+path+" ("+strerror(errno)+")");
+    struct stat st;
+    fstat(fd,&st);
+    length = st.st_size;
+    if (length) {
+        void *map = mmap(nullptr,length,PROT_READ,MAP_PRIVATE,fd,0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Can't map "+path+" ("+strerror(errno)+")");
+        }
+        base = (const uint8_t *)map;
+        if (sequential) madvise(map,length,MADV_SEQUENTIAL);
+    }
+    close(fd);
+    #endif
+}
+
+MappedFile::~MappedFile() {
+    unmap();
+}
+
+void MappedFile::unmap() {
+    #ifdef _WIN32
+    if (base) UnmapViewOfFile(base);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+    file = mapping = nullptr;
+    #else
+    if (base) munmap((void *)base,length);
+    #endif
+    base = nullptr;
+}
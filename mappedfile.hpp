@@ -0,0 +1,22 @@
+#pragma once
+#include "main.hpp"
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+    private:
+        const uint8_t *base = nullptr;
+        size_t length = 0;
+        #ifdef _WIN32
+        void *file = nullptr, *mapping = nullptr; // HANDLEs
+        #endif
+        void unmap();
+    public:
+        // sequential is a hint that it'll be read front to back, once
+        MappedFile(const std::string &path, bool sequential = false);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        const uint8_t *data() const {return base;};
+        size_t size() const {return length;};
+};
@@ -0,0 +1,18 @@
+#pragma once
+#include "main.hpp"
+
+// Glyphs rasterized at build time (tools/bakefont.cpp generates prebaked_fonts.cpp),
+// so the common sizes of the default face never need FreeType or the .ttf file.
+// Coverage is the same as GlyphAtlas would make, glyph after glyph, with runs of zeros
+// packed as a 0 byte followed by the run length (runs don't cross glyphs).
+struct PrebakedFont {
+    const char *name;
+    int size;
+    Dimension cell;
+    uint16_t first, count; // Codepoints
+    const uint8_t *data;
+    size_t dataSize;
+};
+
+extern const PrebakedFont *const prebaked_fonts;
+extern const size_t prebaked_font_count;
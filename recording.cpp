@@ -0,0 +1,224 @@
+#include "recording.hpp"
+#include <zlib.h>
+#include <cerrno>
+#include <iostream>
+
+RecordingWriter recording_writer;
+
+static uint64_t now_us() {
+    return SDL_GetPerformanceCounter()*1000000/SDL_GetPerformanceFrequency();
+}
+
+static void put_varint(std::vector<uint8_t> &out, uint64_t val) {
+    while (val >= 0x80) {
+        out.push_back(uint8_t(val&0x7F)|0x80);
+        val >>= 7;
+    }
+    out.push_back(uint8_t(val));
+}
+
+// Returns false if the file runs out
+static bool get_varint(FILE *f, uint64_t &val) {
+    val = 0;
+    for (int shift=0;shift<64;shift+=7) {
+        int b = fgetc(f);
+        if (b == EOF) return false;
+        val |= uint64_t(b&0x7F)<<shift;
+        if (!(b&0x80)) return true;
+    }
+    return false;
+}
+
+RecordingWriter::RecordingWriter() {
+    mutex = SDL_CreateMutex();
+    wake = SDL_CreateCond();
+    done = SDL_CreateCond();
+    if (!mutex || !wake || !done) throw sdl_error("Failed to create recording writer");
+}
+
+RecordingWriter::~RecordingWriter() {
+    {
+        SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+        quit = true;
+        SDL_CondSignal(wake);
+    }
+    // Finishes the queue before it quits
+    if (thread) SDL_WaitThread(thread,nullptr);
+    SDL_DestroyCond(done);
+    SDL_DestroyCond(wake);
+    SDL_DestroyMutex(mutex);
+}
+
+std::vector<uint32_t> RecordingWriter::getBuffer() {
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    if (spare.empty()) return {};
+    auto buffer = std::move(spare.back());
+    spare.pop_back();
+    return buffer;
+}
+
+bool RecordingWriter::submit(const std::shared_ptr<RecordingFile> &file, RecordedFrame &&frame) {
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    if (!thread) {
+        thread = SDL_CreateThread(run_writer,"Recording Writer",this);
+        if (!thread) throw sdl_error("Failed to create recording writer thread");
+    }
+    size_t bytes = frame.pixels.size()*sizeof(uint32_t);
+    if (queuedBytes && queuedBytes+bytes > MAX_QUEUED_BYTES) {
+        if (spare.size() < MAX_SPARE) spare.push_back(std::move(frame.pixels));
+        return false;
+    }
+    queuedBytes += bytes;
+    queue.push_back({.file=file,.frame=std::move(frame)});
+    SDL_CondSignal(wake);
+    return true;
+}
+
+void RecordingWriter::flush() {
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    while (busy || !queue.empty()) SDL_CondWait(done,mutex);
+}
+
+int RecordingWriter::run_writer(void *ptr) {
+    RecordingWriter &writer = *(RecordingWriter *)ptr;
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    std::vector<uint8_t> rgb, packed, record;
+    SDL_LockMutex(writer.mutex);
+    for (;;) {
+        while (!writer.quit && writer.queue.empty()) SDL_CondWait(writer.wake,writer.mutex);
+        if (writer.queue.empty()) break;
+        Job job = std::move(writer.queue.front());
+        writer.queue.pop_front();
+        writer.queuedBytes -= job.frame.pixels.size()*sizeof(uint32_t);
+        writer.busy = true;
+        SDL_UnlockMutex(writer.mutex);
+
+        RecordedFrame &frame = job.frame;
+        rgb.resize(frame.pixels.size()*3);
+        for (size_t i=0;i<frame.pixels.size();i++) {
+            rgb[i*3+0] = frame.pixels[i]>>16;
+            rgb[i*3+1] = frame.pixels[i]>>8;
+            rgb[i*3+2] = frame.pixels[i];
+        }
+        uLongf packedLen = compressBound(rgb.size());
+        packed.resize(packedLen);
+        if (compress2(packed.data(),&packedLen,rgb.data(),rgb.size(),Z_BEST_SPEED) != Z_OK) {
+            std::cerr << "Failed to compress recording frame" << std::endl;
+        } else {
+            record.clear();
+            put_varint(record,frame.time_us-job.file->last_us);
+            put_varint(record,frame.width);
+            put_varint(record,frame.height);
+            put_varint(record,frame.rects.size());
+            for (auto &rect : frame.rects) {
+                put_varint(record,rect.x);
+                put_varint(record,rect.y);
+                put_varint(record,rect.w);
+                put_varint(record,rect.h);
+            }
+            put_varint(record,packedLen);
+            record.insert(record.end(),packed.begin(),packed.begin()+packedLen);
+            if (fwrite(record.data(),1,record.size(),job.file->file) != record.size()) {
+                std::cerr << "Failed to write recording frame (" << strerror(errno) << ")" << std::endl;
+            }
+            job.file->last_us = frame.time_us;
+        }
+
+        SDL_LockMutex(writer.mutex);
+        job.file.reset(); // Might be the last reference after a STOP
+        writer.busy = false;
+        if (writer.spare.size() < MAX_SPARE) writer.spare.push_back(std::move(frame.pixels));
+        SDL_CondBroadcast(writer.done);
+    }
+    SDL_UnlockMutex(writer.mutex);
+    return 0;
+}
+
+WindowRecorder::WindowRecorder(const std::string &path) {
+    FILE *f = fopen(path.c_str(),"wb");
+    if (!f) throw std::runtime_error("Can't open recording file "+path+" ("+strerror(errno)+")");
+    file = std::make_shared<RecordingFile>();
+    file->file = f;
+    fwrite(recording_magic,1,sizeof(recording_magic),f);
+    fputc(recording_version,f);
+    start = now_us();
+}
+
+void WindowRecorder::capture(SDL_Surface *surface, const std::vector<SDL_Rect> &rects, bool full) {
+    RecordedFrame frame = {.time_us=now_us()-start,.width=surface->w,.height=surface->h};
+    if (needFull || full || rects.empty() || surface->w != width || surface->h != height) {
+        frame.rects.push_back({.x=0,.y=0,.w=surface->w,.h=surface->h});
+    } else {
+        frame.rects = rects;
+    }
+    size_t count = 0;
+    for (auto &rect : frame.rects) count += size_t(rect.w)*rect.h;
+    frame.pixels = recording_writer.getBuffer();
+    frame.pixels.resize(count);
+
+    uint32_t *dst = frame.pixels.data();
+    for (auto &rect : frame.rects) {
+        const uint8_t *src = (const uint8_t *)surface->pixels + rect.y*surface->pitch + rect.x*surface->format->BytesPerPixel;
+        if (SDL_ConvertPixels(rect.w,rect.h,surface->format->format,src,surface->pitch,SDL_PIXELFORMAT_ARGB8888,dst,rect.w*4)) {
+            throw sdl_error("Failed to copy pixels for recording");
+        }
+        dst += size_t(rect.w)*rect.h;
+    }
+
+    width = surface->w;
+    height = surface->h;
+    // Writer's falling behind, the next frame has to be a full one to make up for it
+    needFull = !recording_writer.submit(file,std::move(frame));
+    if (needFull) dropped++;
+    else frames++;
+}
+
+RecordingReader::RecordingReader(const std::string &path) {
+    file = fopen(path.c_str(),"rb");
+    if (!file) throw std::runtime_error("Can't open recording "+path+" ("+strerror(errno)+")");
+    char magic[sizeof(recording_magic)];
+    if (fread(magic,1,sizeof(magic),file) != sizeof(magic) || memcmp(magic,recording_magic,sizeof(magic))) {
+        fclose(file);
+        throw std::runtime_error(path+" isn't a recording");
+    }
+    if (fgetc(file) != recording_version) {
+        fclose(file);
+        throw std::runtime_error(path+" is from an unknown recording version");
+    }
+}
+
+RecordingReader::~RecordingReader() {
+    fclose(file);
+}
+
+bool RecordingReader::next(RecordedFrame &frame) {
+    uint64_t delta, width, height, count, len;
+    if (!get_varint(file,delta)) return false;
+    if (!get_varint(file,width) || !get_varint(file,height) || !get_varint(file,count)) throw std::runtime_error("Truncated recording");
+    if (width > 16384 || height > 16384) throw std::runtime_error("Bad frame size in recording");
+    time_us += delta;
+    frame.time_us = time_us;
+    frame.width = width;
+    frame.height = height;
+    frame.rects.clear();
+    size_t pixels = 0;
+    for (uint64_t i=0;i<count;i++) {
+        uint64_t x, y, w, h;
+        if (!get_varint(file,x) || !get_varint(file,y) || !get_varint(file,w) || !get_varint(file,h)) throw std::runtime_error("Truncated recording");
+        if (x+w > width || y+h > height) throw std::runtime_error("Bad rect in recording");
+        frame.rects.push_back({.x=int(x),.y=int(y),.w=int(w),.h=int(h)});
+        pixels += w*h;
+    }
+    if (!get_varint(file,len)) throw std::runtime_error("Truncated recording");
+    packed.resize(len);
+    if (fread(packed.data(),1,len,file) != len) throw std::runtime_error("Truncated recording");
+
+    std::vector<uint8_t> rgb(pixels*3);
+    uLongf rgbLen = rgb.size();
+    if (uncompress(rgb.data(),&rgbLen,packed.data(),len) != Z_OK || rgbLen != rgb.size()) throw std::runtime_error("Corrupt frame in recording");
+    frame.pixels.resize(pixels);
+    for (size_t i=0;i<pixels;i++) {
+        frame.pixels[i] = 0xFF000000 | rgb[i*3+0]<<16 | rgb[i*3+1]<<8 | rgb[i*3+2];
+    }
+    return true;
+}
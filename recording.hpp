@@ -0,0 +1,91 @@
+#pragma once
+#include "main.hpp"
+#include <cstdio>
+#include <deque>
+
+// Window recordings (RECORD/STOP) keep every presented frame, but only the parts that changed:
+//   "P2DBGREC", version byte, then frames of
+//   varint microseconds since the previous frame, varint width, varint height,
+//   varint rect count, the rects as varint x,y,w,h,
+//   varint length, zlib compressed RGB pixels of all the rects, one after the other.
+// The first frame, and the first after a size change or a dropped frame, is one rect covering everything.
+constexpr char recording_magic[8] = {'P','2','D','B','G','R','E','C'};
+constexpr uint8_t recording_version = 1;
+
+struct RecordedFrame {
+    uint64_t time_us; // Since the start of the recording
+    int width,height;
+    std::vector<SDL_Rect> rects;
+    std::vector<uint32_t> pixels; // ARGB8888 of each rect in turn
+};
+
+// Shared between the window and the writer thread, closed once neither needs it anymore
+struct RecordingFile {
+    FILE *file;
+    uint64_t last_us = 0; // Writer thread only
+    ~RecordingFile() {fclose(file);};
+};
+
+// Compresses and writes the frames of all recordings on a background thread
+class RecordingWriter {
+    private:
+        struct Job {
+            std::shared_ptr<RecordingFile> file;
+            RecordedFrame frame;
+        };
+        SDL_Thread *thread = nullptr; // Started by the first frame
+        SDL_mutex *mutex;
+        SDL_cond *wake, *done;
+        std::deque<Job> queue;
+        size_t queuedBytes = 0;
+        std::vector<std::vector<uint32_t>> spare; // Pixel buffers to reuse
+        bool busy = false, quit = false;
+
+        static int run_writer(void *writer);
+    public:
+        static constexpr size_t MAX_QUEUED_BYTES = 64<<20; // Past that, frames get dropped rather than waited for
+        static constexpr size_t MAX_SPARE = 8;
+
+        RecordingWriter();
+        ~RecordingWriter();
+        RecordingWriter(const RecordingWriter &) = delete;
+        RecordingWriter &operator=(const RecordingWriter &) = delete;
+
+        std::vector<uint32_t> getBuffer();
+        // False if the queue is full, the frame is dropped then
+        bool submit(const std::shared_ptr<RecordingFile> &file, RecordedFrame &&frame);
+        void flush(); // Waits until everything queued is written
+};
+
+extern RecordingWriter recording_writer;
+
+// One window's recording, fed from present() on the main thread
+class WindowRecorder {
+    private:
+        std::shared_ptr<RecordingFile> file;
+        uint64_t start;
+        int width = 0, height = 0; // Of the last frame
+        bool needFull = true;
+        uint64_t frames = 0, dropped = 0;
+    public:
+        WindowRecorder(const std::string &path);
+
+        // Records the rects of the (locked) surface, or all of it with full
+        void capture(SDL_Surface *surface, const std::vector<SDL_Rect> &rects, bool full);
+        uint64_t getFrames() {return frames;};
+        uint64_t getDropped() {return dropped;};
+};
+
+class RecordingReader {
+    private:
+        FILE *file;
+        uint64_t time_us = 0;
+        std::vector<uint8_t> packed;
+    public:
+        RecordingReader(const std::string &path);
+        ~RecordingReader();
+        RecordingReader(const RecordingReader &) = delete;
+        RecordingReader &operator=(const RecordingReader &) = delete;
+
+        bool next(RecordedFrame &frame); // False at the end
+};
@@ -0,0 +1,99 @@
+#include "scrollback.hpp"
+#include "terminal.hpp"
+
+// Row layout: flags, cell count, attribute runs (length, fg RGB, bg RGB), then the characters
+enum : uint8_t {
+    ROW_WRAPPED = 1,
+    ROW_WIDE = 2, // Characters are 16 bit instead of 8
+};
+
+static void put_varint(std::string &out, uint32_t val) {
+    while (val >= 0x80) {
+        out += char(val|0x80);
+        val >>= 7;
+    }
+    out += char(val);
+}
+
+static uint32_t get_varint(const uint8_t *&p) {
+    uint32_t val = 0;
+    for (int shift=0;;shift+=7) {
+        uint8_t b = *p++;
+        val |= uint32_t(b&0x7F)<<shift;
+        if (!(b&0x80)) return val;
+    }
+}
+
+static bool same_color(const SDL_Color &a, const SDL_Color &b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+void Scrollback::push(const uint16_t *chars, const uint8_t *attrs, int count, bool wrapped, const CellPalette &palette, uint8_t blankAttr) {
+    if (!wrapped) {
+        const SDL_Color &blank_bg = palette[blankAttr].bg;
+        while (count > 0 && chars[count-1] == ' ' && same_color(palette[attrs[count-1]].bg,blank_bg)) count--;
+    }
+
+    bool wide = false;
+    for (int i=0;i<count;i++) if (chars[i] > 0xFF) wide = true;
+
+    std::string data;
+    data += char((wrapped?ROW_WRAPPED:0)|(wide?ROW_WIDE:0));
+    put_varint(data,count);
+    for (int i=0;i<count;) {
+        int run = 1;
+        while (i+run < count && attrs[i+run] == attrs[i]) run++;
+        put_varint(data,run);
+        const SDL_Color &fg = palette[attrs[i]].fg, &bg = palette[attrs[i]].bg;
+        data += {char(fg.r),char(fg.g),char(fg.b),char(bg.r),char(bg.g),char(bg.b)};
+        i += run;
+    }
+    for (int i=0;i<count;i++) {
+        data += char(chars[i]);
+        if (wide) data += char(chars[i]>>8);
+    }
+    data.shrink_to_fit();
+
+    used += sizeof(std::string) + data.capacity();
+    rows.push_back(std::move(data));
+    evict();
+}
+
+void Scrollback::evict() {
+    while (used > limit && !rows.empty()) {
+        used -= sizeof(std::string) + rows.front().capacity();
+        rows.pop_front();
+    }
+}
+
+int Scrollback::decodeRow(const std::string &data, uint16_t *chars, uint8_t *attrs, int maxCells, const AttrMapper &attrFor, bool *wrapped) {
+    const uint8_t *p = (const uint8_t *)data.data();
+    uint8_t flags = *p++;
+    int count = get_varint(p);
+    int stored = std::min(count,maxCells);
+
+    for (int i=0;i<count;) {
+        int run = get_varint(p);
+        if (i < stored) {
+            uint8_t attr = attrFor({p[0],p[1],p[2],255},{p[3],p[4],p[5],255});
+            memset(attrs+i,attr,std::min(i+run,stored)-i);
+        }
+        p += 6;
+        i += run;
+    }
+    for (int i=0;i<count;i++) {
+        uint16_t ch = *p++;
+        if (flags&ROW_WIDE) ch |= uint16_t(*p++)<<8;
+        if (i<stored) chars[i] = ch;
+    }
+
+    if (wrapped) *wrapped = flags&ROW_WRAPPED;
+    return stored;
+}
+
+int Scrollback::popBack(uint16_t *chars, uint8_t *attrs, int maxCells, const AttrMapper &attrFor, bool *wrapped) {
+    int stored = decodeRow(rows.back(),chars,attrs,maxCells,attrFor,wrapped);
+    used -= sizeof(std::string) + rows.back().capacity();
+    rows.pop_back();
+    return stored;
+}
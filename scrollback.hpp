@@ -0,0 +1,40 @@
+#pragma once
+#include "main.hpp"
+#include <deque>
+#include <functional>
+
+class CellPalette;
+
+// Rows that scrolled off a terminal, run-length encoded by attributes.
+// Oldest rows get dropped once the memory limit is reached.
+class Scrollback {
+    private:
+        std::deque<std::string> rows;
+        size_t used = 0;
+        size_t limit;
+
+        void evict();
+    public:
+        // Turns colors back into attributes of the terminal decoding the row
+        using AttrMapper = std::function<uint8_t(SDL_Color fg, SDL_Color bg)>;
+    private:
+        static int decodeRow(const std::string &data, uint16_t *chars, uint8_t *attrs, int maxCells, const AttrMapper &attrFor, bool *wrapped);
+    public:
+        static constexpr size_t DEFAULT_LIMIT = 8*1024*1024;
+        Scrollback(size_t limit = DEFAULT_LIMIT) : limit{limit} {};
+
+        // Trailing blanks are dropped unless the row wraps into the next one.
+        // Rows are stored by color, so they outlive the terminal's palette.
+        void push(const uint16_t *chars, const uint8_t *attrs, int count, bool wrapped, const CellPalette &palette, uint8_t blankAttr);
+        // Both return the number of cells actually stored for that row
+        int decode(size_t index, uint16_t *chars, uint8_t *attrs, int maxCells, const AttrMapper &attrFor, bool *wrapped = nullptr) const {
+            return decodeRow(rows[index],chars,attrs,maxCells,attrFor,wrapped);
+        };
+        int popBack(uint16_t *chars, uint8_t *attrs, int maxCells, const AttrMapper &attrFor, bool *wrapped = nullptr);
+
+        size_t size() const {return rows.size();};
+        size_t memoryUsed() const {return used;};
+        size_t getLimit() const {return limit;};
+        void setLimit(size_t bytes) {limit = bytes; evict();};
+        void clear() {rows.clear(); used = 0;};
+};
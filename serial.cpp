@@ -0,0 +1,149 @@
+#include "serial.hpp"
+#include <cerrno>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+
+int open_serial_port(const std::string &path, int baud) {
+    // COM10 and up only work with the device namespace prefix
+    std::string dev = path.rfind("\\\\.\\",0) == 0 ? path : "\\\\.\\"+path;
+    HANDLE h = CreateFileA(dev.c_str(),GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_EXISTING,0,NULL);
+    if (h == INVALID_HANDLE_VALUE) throw std::runtime_error("Can't open serial port "+path);
+
+    DCB dcb = {.DCBlength=sizeof(DCB)};
+    GetCommState(h,&dcb);
+    dcb.BaudRate = baud; // Drivers take arbitrary rates here
+    dcb.fBinary = TRUE;
+    dcb.fParity = FALSE;
+    dcb.ByteSize = 8;
+    dcb.Parity = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    dcb.fOutxCtsFlow = dcb.fOutxDsrFlow = FALSE;
+    dcb.fDtrControl = DTR_CONTROL_DISABLE; // DTR would reset the P2
+    dcb.fRtsControl = RTS_CONTROL_DISABLE;
+    dcb.fOutX = dcb.fInX = FALSE;
+    if (!SetCommState(h,&dcb)) {
+        CloseHandle(h);
+        throw std::runtime_error("Can't set "+path+" to "+std::to_string(baud)+" baud");
+    }
+    SetupComm(h,1<<20,4096);
+
+    // Return as soon as anything arrives, with as much as there is
+    COMMTIMEOUTS timeouts = {
+        .ReadIntervalTimeout=MAXDWORD,
+        .ReadTotalTimeoutMultiplier=MAXDWORD,
+        .ReadTotalTimeoutConstant=MAXDWORD-1,
+    };
+    SetCommTimeouts(h,&timeouts);
+
+    int fd = _open_osfhandle(intptr_t(h),_O_RDONLY|_O_BINARY);
+    if (fd < 0) {
+        CloseHandle(h);
+        throw std::runtime_error("Can't get descriptor for "+path);
+    }
+    return fd;
+}
+
+#else
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <asm/ioctls.h>
+// <asm/termbits.h> clashes with <termios.h>, so declare what's needed for custom rates
+struct termios2 {
+    tcflag_t c_iflag,c_oflag,c_cflag,c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed,c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#endif
+#ifdef __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
+
+static speed_t baud_constant(int baud) {
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    #ifdef B460800
+    case 460800: return B460800;
+    #endif
+    #ifdef B921600
+    case 921600: return B921600;
+    #endif
+    #ifdef B1000000
+    case 1000000: return B1000000;
+    #endif
+    #ifdef B2000000
+    case 2000000: return B2000000;
+    #endif
+    #ifdef B3000000
+    case 3000000: return B3000000;
+    #endif
+    #ifdef B4000000
+    case 4000000: return B4000000;
+    #endif
+    default: return 0;
+    }
+}
+
+int open_serial_port(const std::string &path, int baud) {
+    int fd = open(path.c_str(),O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if (fd < 0) throw std::runtime_error("Can't open serial port "+path+" ("+strerror(errno)+")");
+
+    auto fail = [&](const std::string &what) {
+        std::string err = strerror(errno);
+        close(fd);
+        return std::runtime_error(what+" on "+path+" ("+err+")");
+    };
+
+    struct termios tio;
+    if (tcgetattr(fd,&tio)) throw fail("tcgetattr failed");
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL|CREAD;
+    tio.c_cflag &= ~(CSTOPB|CRTSCTS|HUPCL); // Dropping DTR on close would reset the P2
+    tio.c_iflag &= ~(IXON|IXOFF|IXANY);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+
+    speed_t speed = baud_constant(baud);
+    if (speed) {
+        cfsetispeed(&tio,speed);
+        cfsetospeed(&tio,speed);
+    }
+    if (tcsetattr(fd,TCSANOW,&tio)) throw fail("tcsetattr failed");
+
+    if (!speed) {
+        // Not one of the usual rates, ask the driver for it directly
+        #if defined(__linux__)
+        struct termios2 tio2;
+        if (ioctl(fd,TCGETS2,&tio2)) throw fail("TCGETS2 failed");
+        tio2.c_cflag &= ~CBAUD;
+        tio2.c_cflag |= BOTHER;
+        tio2.c_ispeed = tio2.c_ospeed = baud;
+        if (ioctl(fd,TCSETS2,&tio2)) throw fail("Can't set "+std::to_string(baud)+" baud");
+        #elif defined(__APPLE__)
+        speed_t custom = baud;
+        if (ioctl(fd,IOSSIOSPEED,&custom)) throw fail("Can't set "+std::to_string(baud)+" baud");
+        #else
+        close(fd);
+        throw std::runtime_error("Unsupported baud rate "+std::to_string(baud));
+        #endif
+    }
+
+    tcflush(fd,TCIFLUSH); // Stale data from before we were listening
+    return fd;
+}
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+#include "main.hpp"
+
+constexpr int default_baud = 2000000; // Same as the P2's DEBUG_BAUD default
+
+// Opens a serial port (or any tty, e.g. a pty) in raw 8N1 mode at the given
+// rate and returns a file descriptor for InputPipeline. Throws on failure.
+int open_serial_port(const std::string &path, int baud);
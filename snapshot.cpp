@@ -0,0 +1,156 @@
+#include "snapshot.hpp"
+#include <zlib.h>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+
+SnapshotWriter snapshot_writer;
+
+SnapshotWriter::SnapshotWriter() {
+    mutex = SDL_CreateMutex();
+    wake = SDL_CreateCond();
+    done = SDL_CreateCond();
+    if (!mutex || !wake || !done) throw sdl_error("Failed to create snapshot writer");
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    {
+        SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+        quit = true;
+        SDL_CondSignal(wake);
+    }
+    // Finishes the queue before it quits
+    if (thread) SDL_WaitThread(thread,nullptr);
+    SDL_DestroyCond(done);
+    SDL_DestroyCond(wake);
+    SDL_DestroyMutex(mutex);
+}
+
+void SnapshotWriter::save(SDL_Surface *surface, std::string path) {
+    std::vector<uint32_t> pixels;
+    {
+        SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+        if (!thread) {
+            thread = SDL_CreateThread(run_writer,"Snapshot Writer",this);
+            if (!thread) throw sdl_error("Failed to create snapshot writer thread");
+        }
+        while (queue.size() >= MAX_QUEUED) SDL_CondWait(done,mutex);
+        if (!spare.empty()) {
+            pixels = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    // Straight copy for the usual 32 bit formats, anything else gets converted on the way
+    pixels.resize(size_t(surface->w)*surface->h);
+    if (SDL_ConvertPixels(surface->w,surface->h,surface->format->format,surface->pixels,surface->pitch,
+                          SDL_PIXELFORMAT_ARGB8888,pixels.data(),surface->w*4)) {
+        throw sdl_error("Failed to copy pixels for screenshot");
+    }
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    queue.push_back({.path=std::move(path),.width=surface->w,.height=surface->h,.pixels=std::move(pixels)});
+    SDL_CondSignal(wake);
+}
+
+void SnapshotWriter::flush() {
+    SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+    while (busy || !queue.empty()) SDL_CondWait(done,mutex);
+}
+
+int SnapshotWriter::run_writer(void *ptr) {
+    SnapshotWriter &writer = *(SnapshotWriter *)ptr;
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    SDL_LockMutex(writer.mutex);
+    for (;;) {
+        while (!writer.quit && writer.queue.empty()) SDL_CondWait(writer.wake,writer.mutex);
+        if (writer.queue.empty()) break;
+        Job job = std::move(writer.queue.front());
+        writer.queue.pop_front();
+        writer.busy = true;
+        SDL_UnlockMutex(writer.mutex);
+
+        try {
+            auto png = encode_png(job.pixels.data(),job.width,job.height);
+            FILE *file = fopen(job.path.c_str(),"wb");
+            if (!file) throw std::runtime_error("Can't open "+job.path+" ("+strerror(errno)+")");
+            bool ok = fwrite(png.data(),1,png.size(),file) == png.size();
+            if (fclose(file) || !ok) throw std::runtime_error("Failed to write "+job.path);
+        } catch (std::exception &e) {
+            // Nobody to throw to over here, so just complain
+            std::cerr << "SAVE failed: " << e.what() << std::endl;
+        }
+
+        SDL_LockMutex(writer.mutex);
+        writer.busy = false;
+        if (writer.spare.size() < MAX_SPARE) writer.spare.push_back(std::move(job.pixels));
+        SDL_CondBroadcast(writer.done);
+    }
+    SDL_UnlockMutex(writer.mutex);
+    return 0;
+}
+
+static void put_be32(std::vector<uint8_t> &out, uint32_t val) {
+    uint8_t bytes[4] = {uint8_t(val>>24),uint8_t(val>>16),uint8_t(val>>8),uint8_t(val)};
+    out.insert(out.end(),bytes,bytes+4);
+}
+
+static void put_chunk(std::vector<uint8_t> &out, const char *type, const uint8_t *data, size_t len) {
+    put_be32(out,len);
+    size_t start = out.size();
+    out.insert(out.end(),type,type+4);
+    out.insert(out.end(),data,data+len);
+    put_be32(out,crc32(0,&out[start],len+4));
+}
+
+std::vector<uint8_t> encode_png(const uint32_t *pixels, int width, int height) {
+    // Every row gets whichever of the None/Sub/Up filters leaves the smallest values (like libpng does).
+    // Text on flat backgrounds mostly turns into zeros, which is what deflate likes best.
+    size_t rowBytes = size_t(width)*3;
+    std::vector<uint8_t> filtered(height*(rowBytes+1));
+    std::vector<uint8_t> raw(rowBytes), prev(rowBytes,0), sub(rowBytes), up(rowBytes);
+    for (int y=0;y<height;y++) {
+        const uint32_t *src = pixels+size_t(y)*width;
+        for (int x=0;x<width;x++) {
+            raw[x*3+0] = src[x]>>16;
+            raw[x*3+1] = src[x]>>8;
+            raw[x*3+2] = src[x];
+        }
+        uint32_t sumNone = 0, sumSub = 0, sumUp = 0;
+        for (size_t i=0;i<rowBytes;i++) {
+            sub[i] = raw[i] - (i >= 3 ? raw[i-3] : 0);
+            up[i] = raw[i] - prev[i];
+            sumNone += std::min<int>(raw[i],256-raw[i]);
+            sumSub += std::min<int>(sub[i],256-sub[i]);
+            sumUp += std::min<int>(up[i],256-up[i]);
+        }
+        uint8_t *dst = &filtered[y*(rowBytes+1)];
+        if (sumNone <= sumSub && sumNone <= sumUp) {
+            dst[0] = 0;
+            memcpy(dst+1,raw.data(),rowBytes);
+        } else if (sumSub <= sumUp) {
+            dst[0] = 1;
+            memcpy(dst+1,sub.data(),rowBytes);
+        } else {
+            dst[0] = 2;
+            memcpy(dst+1,up.data(),rowBytes);
+        }
+        std::swap(prev,raw);
+    }
+
+    uLongf packedLen = compressBound(filtered.size());
+    std::vector<uint8_t> packed(packedLen);
+    // Fastest setting, screenshots of text still shrink plenty
+    if (compress2(packed.data(),&packedLen,filtered.data(),filtered.size(),Z_BEST_SPEED) != Z_OK) {
+        throw std::runtime_error("Failed to compress screenshot");
+    }
+
+    static const uint8_t signature[8] = {0x89,'P','N','G','\r','\n',0x1A,'\n'};
+    std::vector<uint8_t> out(signature,signature+8);
+    std::vector<uint8_t> header;
+    put_be32(header,width);
+    put_be32(header,height);
+    header.insert(header.end(),{8,2,0,0,0}); // 8 bit, RGB, deflate, adaptive filters, no interlace
+    put_chunk(out,"IHDR",header.data(),header.size());
+    put_chunk(out,"IDAT",packed.data(),packedLen);
+    put_chunk(out,"IEND",nullptr,0);
+    return out;
+}
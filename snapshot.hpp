@@ -0,0 +1,39 @@
+#pragma once
+#include "main.hpp"
+#include <deque>
+
+// Writes SAVE screenshots as PNG on a background thread,
+// so the display keeps going while zlib does its thing.
+class SnapshotWriter {
+    private:
+        struct Job {
+            std::string path;
+            int width, height;
+            std::vector<uint32_t> pixels; // ARGB8888, no padding between rows
+        };
+        SDL_Thread *thread = nullptr; // Started by the first save
+        SDL_mutex *mutex;
+        SDL_cond *wake, *done;
+        std::deque<Job> queue;
+        std::vector<std::vector<uint32_t>> spare; // Pixel buffers to reuse
+        bool busy = false, quit = false;
+
+        static int run_writer(void *writer);
+    public:
+        static constexpr size_t MAX_QUEUED = 8; // Past that, save() waits instead of piling up memory
+        static constexpr size_t MAX_SPARE = 4;
+
+        SnapshotWriter();
+        ~SnapshotWriter();
+        SnapshotWriter(const SnapshotWriter &) = delete;
+        SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+        // Copies the (locked) surface and queues it to be written to path
+        void save(SDL_Surface *surface, std::string path);
+        void flush(); // Waits until everything queued is written
+};
+
+extern SnapshotWriter snapshot_writer;
+
+// Whole PNG file for the pixels, 8 bit RGB
+std::vector<uint8_t> encode_png(const uint32_t *pixels, int width, int height);
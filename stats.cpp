@@ -0,0 +1,14 @@
+#include "stats.hpp"
+
+PerfStats perf_stats;
+
+StatsWindow::StatsWindow() {
+    global_bg = current_bg = {0,0,0};
+    resize({.cols=64,.rows=24});
+    clear();
+}
+
+void StatsWindow::show(std::string_view text) {
+    clear();
+    putString(text);
+}
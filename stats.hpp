@@ -0,0 +1,33 @@
+#pragma once
+#include "main.hpp"
+#include "terminal.hpp"
+#include <atomic>
+
+// Cheap counters for the STATS window and the summary on exit.
+// Input side counters live in InputPipeline, per-window lines in DebugWindow.
+struct PerfStats {
+    // Main thread only
+    uint64_t linesDispatched = 0;
+    uint64_t parseTicks = 0;
+    uint64_t frames = 0; // Frames that had anything to repaint
+    uint64_t repaintTicks = 0, repaintMaxTicks = 0;
+    uint64_t windowsRendered = 0;
+    // Counted by the render workers
+    std::atomic<uint64_t> cellsRendered = 0;
+    std::atomic<uint64_t> cellsSkipped = 0; // Dirty, but the canvas already showed them
+};
+
+extern PerfStats perf_stats;
+
+inline double ticks_to_ms(uint64_t ticks) {
+    return double(ticks)*1000/SDL_GetPerformanceFrequency();
+}
+
+// Plain text readout of the stats, toggled with F12
+class StatsWindow : public TerminalWindow {
+    public:
+        StatsWindow();
+        virtual const char *get_title() {return "STATS";};
+        virtual void selectColors(int i) {};
+        void show(std::string_view text); // Replaces the contents
+};
@@ -1,52 +1,109 @@
 #include "terminal.hpp"
+#include "keywords.hpp"
+#include "stats.hpp"
 #include <algorithm>
 #include <iostream>
 
-TerminalWindow::TerminalWindow() : grid{nullptr}, global_bg{0,0,0},current_fg{0,255,0},current_bg{0,0,64} {
+TerminalWindow::TerminalWindow() : global_bg{0,0,0},current_fg{0,255,0},current_bg{0,0,64} {
     resize({.cols=40,.rows=20});
 }
 
-MainTerminalWindow::MainTerminalWindow() {
+MainTerminalWindow::MainTerminalWindow(std::string title) : title{title} {
     global_bg = {0,0,64};
     resize({.cols=40,.rows=25});
     clear();
 }
 
 DebugTerminalWindow::DebugTerminalWindow(std::string title) : DebugWindow(title),TerminalWindow(),term_colors{default_colors} {
+    config.size = termDim;
+    config.textSize = using_font.size;
+    config.backColor = global_bg;
+    config.colors = term_colors;
     selectColors(0);
 }
 
 
 void TerminalWindow::resize(TerminalDimension newdim) {
+    if (newdim == termDim && !gridChars.empty()) return; // Nothing to do
     auto oldDim = termDim;
     termDim = newdim;
 
-    auto oldGrid = grid;
-
-    grid = new termchar_t[termDim.cols*termDim.rows];
+    std::vector<uint16_t> oldChars = std::move(gridChars);
+    std::vector<uint8_t> oldAttrs = std::move(gridAttrs);
+    gridChars.resize(termDim.cols*termDim.rows);
+    gridAttrs.resize(termDim.cols*termDim.rows);
 
+    uint8_t blank = blankAttr();
+    std::vector<uint8_t> newFlags(termDim.rows);
+    int keepCols = 0;
     for (int y=0;y<termDim.rows;y++) {
-        for (int x=0;x<termDim.cols;x++) {
-            termchar_t *c = &grid[y*termDim.cols+x];
-            if (oldGrid && x<oldDim.cols && y<oldDim.rows) *c = oldGrid[y*oldDim.cols+x];
-            else *c = {.ch=' ',.fg=current_fg,.bg=global_bg};
+        uint16_t *chars = &gridChars[y*termDim.cols];
+        uint8_t *attrs = &gridAttrs[y*termDim.cols];
+        if (!oldChars.empty() && y<oldDim.rows) {
+            int oldPhys = (y+rowOffset)%oldDim.rows;
+            keepCols = std::min(oldDim.cols,termDim.cols);
+            memcpy(chars,&oldChars[oldPhys*oldDim.cols],keepCols*sizeof(uint16_t));
+            memcpy(attrs,&oldAttrs[oldPhys*oldDim.cols],keepCols);
+            newFlags[y] = wrapFlags[oldPhys];
+        } else {
+            keepCols = 0;
         }
+        std::fill(chars+keepCols,chars+termDim.cols,' ');
+        memset(attrs+keepCols,blank,termDim.cols-keepCols);
     }
-
-    if (oldGrid) delete oldGrid;
+    wrapFlags = std::move(newFlags);
+    rowOffset = 0;
+    dirtyWords = (termDim.cols+63)/64;
+    dirtyBits.assign(size_t(dirtyWords)*termDim.rows,0);
 
     cursorX = std::clamp(cursorX,0,termDim.cols-1);
-    cursorY = std::clamp(cursorX,0,termDim.rows-1);
+    cursorY = std::clamp(cursorY,0,termDim.rows-1);
     allDirty();
 }
 
 void TerminalWindow::clear() {
-    for(int y=0;y<termDim.rows;y++)for(int x=0;x<termDim.cols;x++) setCharAt(x,y,{.ch=' ',.fg=current_fg,.bg=global_bg});
+    rowOffset = 0;
+    std::fill(gridChars.begin(),gridChars.end(),' ');
+    std::fill(gridAttrs.begin(),gridAttrs.end(),blankAttr());
+    std::fill(wrapFlags.begin(),wrapFlags.end(),0);
     cursorX = cursorY = 0;
     lastSpecial = lastNewLine = 0;
     allDirty();
 }
 
+uint8_t TerminalWindow::attrFor(SDL_Color fg, SDL_Color bg) {
+    int attr = palette.find(fg,bg);
+    if (attr < 0) {
+        // Lots of COLOR changes, make room by dropping what's not on screen anymore
+        compactPalette();
+        attr = palette.find(fg,bg);
+        if (attr < 0) attr = 0; // 256 different pairs on screen?!
+    }
+    return attr;
+}
+
+void TerminalWindow::compactPalette() {
+    std::bitset<CellPalette::MAX_PAIRS> used;
+    for (uint8_t attr : gridAttrs) used.set(attr);
+    for (uint8_t attr : shownAttrs) used.set(attr);
+    auto remap = palette.compact(used);
+    for (uint8_t &attr : gridAttrs) attr = remap[attr];
+    for (uint8_t &attr : shownAttrs) attr = remap[attr];
+}
+
+std::array<uint8_t,CellPalette::MAX_PAIRS> CellPalette::compact(const std::bitset<MAX_PAIRS> &used) {
+    std::array<uint8_t,MAX_PAIRS> remap = {};
+    size_t kept = 0;
+    for (size_t i=0;i<pairs.size();i++) {
+        if (!used.test(i)) continue;
+        remap[i] = kept;
+        pairs[kept++] = pairs[i];
+    }
+    pairs.resize(kept);
+    last = -1;
+    return remap;
+}
+
 void TerminalWindow::putChar(wchar_t c) {
     wchar_t thisNewLine = 0;
     wchar_t thisSpecial = 0;
@@ -91,7 +148,7 @@ void TerminalWindow::putChar(wchar_t c) {
             return;
         case 14 ... 31: break; // Unused?
         default:
-            if (cursorX >= termDim.cols) newLine();
+            if (cursorX >= termDim.cols) newLine(true);
             setCharAt(cursorX++,cursorY,c);
             break;
         }
@@ -101,11 +158,75 @@ void TerminalWindow::putChar(wchar_t c) {
     lastSpecial = thisSpecial;
 }
 
-void TerminalWindow::newLine() {
+void TerminalWindow::putString(std::string_view str) {
+    const char *p = str.data(), *end = p+str.size();
+    while (p < end) {
+        // Control codes (and whatever follows a cursor positioning code) go through putChar
+        if (lastSpecial || uint8_t(*p) < 32) {
+            putChar(uint8_t(*p++));
+            continue;
+        }
+        const char *run = p;
+        while (p < end && uint8_t(*p) >= 32) p++;
+        putRun(run,p-run);
+    }
+}
+
+void TerminalWindow::putRun(const char *str, int len) {
+    lastNewLine = lastSpecial = 0;
+    while (len > 0) {
+        if (cursorX >= termDim.cols) newLine(true);
+        int count = std::min(len,termDim.cols-cursorX);
+        uint16_t *chars = rowChars(cursorY)+cursorX;
+        for (int i=0;i<count;i++) chars[i] = uint8_t(str[i]);
+        memset(rowAttrs(cursorY)+cursorX,currentAttr(),count);
+        markDirty(cursorX,cursorY,cursorX+count-1,cursorY);
+        cursorX += count;
+        str += count;
+        len -= count;
+    }
+}
+
+void TerminalWindow::markDirty(int xmin,int ymin,int xmax,int ymax) {
+    dirty = true;
+    if (fullRepaint) return;
+    for (int y=ymin;y<=ymax;y++) {
+        uint64_t *bits = &dirtyBits[physRow(y)*dirtyWords];
+        for (int x=xmin;x<=xmax;) {
+            // Up to the end of this word
+            int bit = x&63, count = std::min(64-bit,xmax-x+1);
+            bits[x>>6] |= (count == 64 ? ~uint64_t(0) : ((uint64_t(1)<<count)-1)) << bit;
+            x += count;
+        }
+    }
+}
+
+// Finds the next set (or with invert, clear) bit at or after x, returns end if there's none
+static int scan_bits(const uint64_t *bits, int x, int end, bool invert) {
+    while (x < end) {
+        uint64_t word = bits[x>>6] ^ (invert ? ~uint64_t(0) : 0);
+        word &= ~uint64_t(0) << (x&63);
+        if (word) return std::min(end,(x&~63)+__builtin_ctzll(word));
+        x = (x&~63)+64;
+    }
+    return end;
+}
+
+void TerminalWindow::newLine(bool wrap) {
+    rowWrapped(cursorY) = wrap;
     if (cursorY >= termDim.rows-1) {
-        memmove(&grid[0],&grid[termDim.cols],termDim.cols*(termDim.rows-1)*sizeof(termchar_t));
-        for (int i=0;i<termDim.cols;i++) setCharAt(i,termDim.rows-1,' ');
-        allDirty();
+        scrolledOff({rowChars(0),rowAttrs(0)},rowWrapped(0));
+        // Rotate the ring, the old top row becomes the new bottom row
+        if (++rowOffset >= termDim.rows) rowOffset = 0;
+        if (!fullRepaint) {
+            // Whatever was already drawn just moves up with it, see repaint.
+            // The dirty bits go by physical row, so they move along by themselves.
+            pendingScroll++;
+            if (pendingScroll >= termDim.rows) allDirty();
+        }
+        fillCells(termDim.rows-1,0,termDim.cols,' ',currentAttr());
+        markDirty(0,termDim.rows-1,termDim.cols-1,termDim.rows-1);
+        rowWrapped(termDim.rows-1) = 0;
     } else {
         cursorY++;
     }
@@ -113,123 +234,214 @@ void TerminalWindow::newLine() {
 }
 
 
-void TerminalWindow::repaint() {
-
-
+bool TerminalWindow::prepare() {
     Dimension glyphDims = fnt.getGlyphDims();
     //std::cout << "gylph dims are " << glyphDims.width << " and " << glyphDims.height << std::endl;  
     dim = {.width=glyphDims.width*termDim.cols,.height=glyphDims.height*termDim.rows};
 
-    AppWindow::repaint(); // Make sure window is ready
-
-    int repaintXMin = std::clamp(dirtyXMin,0,termDim.cols-1);
-    int repaintYMin = std::clamp(dirtyYMin,0,termDim.rows-1);
-    int repaintXMax = std::clamp(dirtyXMax,0,termDim.cols-1);
-    int repaintYMax = std::clamp(dirtyYMax,0,termDim.rows-1);
-
-    bool needSurfaceRepaint = !(repaintXMin > repaintXMax || repaintYMin > repaintYMax);
-    //std::cout << "dirty area is {[" << dirtyXMin << "," << dirtyXMax << "],[" << dirtyYMin << "," << dirtyYMax << "]}" << std::endl;
-    //std::cout << "repaint area is {[" << repaintXMin << "," << repaintXMax << "],[" << repaintYMin << "," << repaintYMax << "]}" << std::endl;
+    if (!AppWindow::prepare()) return false; // Make sure window is ready
+    invalidateShown(); // Fresh canvas
+    return true;
+}
 
-    if (needSurfaceRepaint) {
+void TerminalWindow::render() {
+    Dimension glyphDims = fnt.getGlyphDims();
 
-        SDL_Surface *win_surf = SDL_GetWindowSurface(handle);
+    size_t gridSize = size_t(termDim.cols)*termDim.rows;
+    if (shownChars.size() != gridSize) {
+        shownChars.assign(gridSize,' ');
+        shownAttrs.assign(gridSize,0);
+        invalidateShown();
+    }
+    // Without a valid shadow, every cell gets painted
+    bool compare = shownValid;
 
-        
+    // Move everything drawn before the scroll(s) up in one go, only the new rows need rendering
+    bool scrolled = pendingScroll > 0;
+    if (scrolled) {
+        int shift = pendingScroll*glyphDims.height;
+        int height = std::min(dim.height,canvas->h);
+        uint8_t *pixels = (uint8_t *)canvas->pixels;
+        if (height > shift) memmove(pixels,pixels+shift*canvas->pitch,(height-shift)*canvas->pitch);
+        // The shadow moves along with the pixels
+        size_t shiftCells = size_t(pendingScroll)*termDim.cols;
+        memmove(shownChars.data(),shownChars.data()+shiftCells,(gridSize-shiftCells)*sizeof(uint16_t));
+        memmove(shownAttrs.data(),shownAttrs.data()+shiftCells,gridSize-shiftCells);
+        pendingScroll = 0;
+    }
 
-        // TODO: arguably this is very terrible, needs glyph cache
-        for (int y=repaintYMin;y<=repaintYMax;y++) {
-            for (int x=repaintXMin;x<=repaintXMax;x++) {
-                termchar_t chr = getCharAt(x,y);
-                SDL_Surface *glyph = TTF_RenderGlyph_Shaded(fnt.get(),chr.ch,chr.fg,chr.bg);
-                SDL_Rect target = {.x=x*glyphDims.width,.y=y*glyphDims.height,.w=glyphDims.width,.h=glyphDims.height};
-                if (glyph->w < glyphDims.width || glyph->h < glyphDims.height) {
-                    if(SDL_FillRect(win_surf,&target,SDL_MapRGB(win_surf->format,chr.bg.r,chr.bg.g,chr.bg.b))) {
-                        throw sdl_error("glyph BG fill failed");
-                    }
-                }
-                if(SDL_BlitSurface(glyph,NULL,win_surf,&target)) throw sdl_error("glyph blit failed");
-                SDL_FreeSurface(glyph);
+    GlyphPainter painter(canvas,glyphDims);
+    uint64_t cells = 0, skipped = 0;
+    auto addRect = [&](int y, int xmin, int xmax) {
+        SDL_Rect rect = {.x=xmin*glyphDims.width,.y=y*glyphDims.height,.w=(xmax-xmin)*glyphDims.width,.h=glyphDims.height};
+        // Same span as the row above? Then it's just a taller rectangle
+        if (!presentRects.empty()) {
+            SDL_Rect &last = presentRects.back();
+            if (last.x == rect.x && last.w == rect.w && last.y+last.h == rect.y) {
+                last.h += rect.h;
+                return;
+            }
+        }
+        presentRects.push_back(rect);
+    };
+    auto paintRun = [&](int y, RowView line, int xmin, int xmax) {
+        uint16_t *shownC = &shownChars[y*termDim.cols];
+        uint8_t *shownA = &shownAttrs[y*termDim.cols];
+        auto same = [&](int x) {return compare && shownC[x] == line.chars[x] && shownA[x] == line.attrs[x];};
+        for (int x=xmin;x<xmax;) {
+            // Skip what's already on the canvas, e.g. a status line written over with the same text
+            int start = x;
+            while (x < xmax && same(x)) x++;
+            skipped += x-start;
+            if (x >= xmax) break;
+            start = x;
+            for (;x < xmax && !same(x);x++) {
+                const ColorPair &colors = palette[line.attrs[x]];
+                painter.paint(fnt.getGlyph(line.chars[x]),colors.fg,colors.bg,x*glyphDims.width,y*glyphDims.height);
+                shownC[x] = line.chars[x];
+                shownA[x] = line.attrs[x];
             }
+            cells += x-start;
+            addRect(y,start,x);
         }
+    };
 
+    for (int y=0;y<termDim.rows;y++) {
+        if (fullRepaint) {
+            paintRun(y,displayRow(y),0,termDim.cols);
+            continue;
+        }
+        const uint64_t *bits = &dirtyBits[physRow(y)*dirtyWords];
+        int x = scan_bits(bits,0,termDim.cols,false);
+        if (x >= termDim.cols) continue;
+        RowView line = displayRow(y);
+        while (x < termDim.cols) {
+            int runEnd = scan_bits(bits,x,termDim.cols,true);
+            paintRun(y,line,x,runEnd);
+            x = scan_bits(bits,runEnd,termDim.cols,false);
+        }
     }
-    
-    if (needSurfaceRepaint) {
-        SDL_Rect target = {.x=repaintXMin*glyphDims.width,.y=repaintYMin*glyphDims.height,.w=(repaintXMax+1)*glyphDims.width,.h=(repaintYMax+1)*glyphDims.height};
-        SDL_UpdateWindowSurfaceRects(handle,&target,1);
-    } else {
-        SDL_UpdateWindowSurface(handle);
-    }
+    // Everything moved, or so many bits and pieces that one big update is cheaper
+    if (!compare || scrolled || presentRects.size() > 256) presentAll = true;
+    shownValid = true;
+
+    fnt.getAtlas().countLookups(cells);
+    perf_stats.cellsRendered.fetch_add(cells,std::memory_order_relaxed);
+    perf_stats.cellsSkipped.fetch_add(skipped,std::memory_order_relaxed);
     allClean();
 }
 
-void DebugTerminalWindow::parse_setup(const std::string &str) {
-    auto iter = token_iterator::begin(str);
-    auto end = token_iterator::end(str);
+enum class TermSetupSym {SIZE,TEXTSIZE,BACKCOLOR,COLOR};
+static constexpr auto term_setup_keywords = make_keyword_table<TermSetupSym>({
+    {"SIZE",TermSetupSym::SIZE},
+    {"TEXTSIZE",TermSetupSym::TEXTSIZE},
+    {"BACKCOLOR",TermSetupSym::BACKCOLOR},
+    {"COLOR",TermSetupSym::COLOR},
+});
+
+enum class TermDataSym {CLEAR};
+static constexpr auto term_data_keywords = make_keyword_table<TermDataSym>({
+    {"CLEAR",TermDataSym::CLEAR},
+});
+
+static bool same_colors(const SDL_Color &a, const SDL_Color &b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+void DebugTerminalWindow::applyConfig(const Config &next) {
+    if (next.size != config.size) resize(next.size);
+    if (next.textSize != config.textSize) {
+        using_font.size = next.textSize;
+        fnt = loadFont();
+        invalidateShown();
+    }
+    // Only used for blanking from here on, so this one's free anyways
+    global_bg = next.backColor;
+    if (!std::equal(next.colors.begin(),next.colors.end(),config.colors.begin(),same_colors)) {
+        term_colors = next.colors;
+        selectColors(last_selected_colors);
+    }
+    config = next;
+}
+
+void DebugTerminalWindow::parse_setup(std::string_view str) {
+    Config next = config;
+    tokens.scan(str);
+    auto iter = tokens.begin();
+    auto end = tokens.end();
     while (iter!=end) {
         /*
-        std::cout << "Got token of size " << iter->length() << " and kind " << iter.classify() << " and offset " << int(iter->data() - str.c_str()) <<std::endl;
+        std::cout << "Got token of size " << iter->length() << " and kind " << iter.classify() << " and offset " << int(iter->data() - str.data()) <<std::endl;
         std::cout << "first char is '" <<  iter->front() << "'\n";
         if (iter->length()) std::cout << "contents are: " << *iter << std::endl;
         SDL_Delay(200);
         */
         
         auto symbol = iter.get_symbol("Getting next setup symbol");
-        std::cout << "trying to parse setup symbol "<<symbol<<std::endl;
+        DEBUG_TRACE("trying to parse setup symbol "<<symbol<<std::endl);
         if (try_parse_common_setup_sym(symbol,iter)) {
             // We good.
-        } else if (casecompare(symbol,"SIZE")) {
-            int cols = iter.get_int("Getting column count");
-            int rows = iter.get_int("Getting row count");
-            std::cout << "resizing to " << cols << ", " << rows <<std::endl;
-            resize({.cols=cols,.rows=rows});
-            std::cout << "token after getting size: " << *iter << std::endl;
-        } else if (casecompare(symbol,"TEXTSIZE")) {
-            int size = iter.get_int("Getting TEXTSIZE");
-            using_font.size = size;
-            fnt = loadFont();
-            allDirty();
-        } else if (casecompare(symbol,"BACKCOLOR")) {
-            global_bg = iter.get_color();
-        } else if (casecompare(symbol,"COLOR")) {       
-            for(int i = 0;;i++) {
-                std::cout << "alleged color is "<<*iter<<std::endl;
-                bool is_color = iter.is_color();
-                if (i==0 && !is_color) throw token_error("expected at least one color");
-                if (i>=8 && is_color) throw token_error("too many colors");
-                if (!is_color) break;
-                term_colors[i] = iter.get_color();
+        } else if (auto sym = term_setup_keywords.find(symbol)) {
+            switch (*sym) {
+            case TermSetupSym::SIZE: {
+                int cols = iter.get_int("Getting column count");
+                int rows = iter.get_int("Getting row count");
+                if (cols < 1 || rows < 1) throw token_error("Terminal SIZE must be at least 1 by 1");
+                DEBUG_TRACE("resizing to " << cols << ", " << rows <<std::endl);
+                next.size = {.cols=cols,.rows=rows};
+                DEBUG_TRACE("token after getting size: " << *iter << std::endl);
+            } break;
+            case TermSetupSym::TEXTSIZE:
+                next.textSize = iter.get_int("Getting TEXTSIZE");
+                break;
+            case TermSetupSym::BACKCOLOR:
+                next.backColor = iter.get_color();
+                break;
+            case TermSetupSym::COLOR:
+                for(int i = 0;;i++) {
+                    DEBUG_TRACE("alleged color is "<<*iter<<std::endl);
+                    bool is_color = iter.is_color();
+                    if (i==0 && !is_color) throw token_error("expected at least one color");
+                    if (i>=8 && is_color) throw token_error("too many colors");
+                    if (!is_color) break;
+                    next.colors[i] = iter.get_color();
+                }
+                break;
             }
-            selectColors(last_selected_colors);
         } else {
             std::cerr << "Unhandled symbol " << symbol << std::endl;
             while (iter != end && iter.classify() != token_iterator::TOKEN_SYMBOL) ++iter;
         }
     }
-    clear(); // Clear it!
+    applyConfig(next);
+    // A fresh setup means a blank terminal. Cheap when the same text gets written again,
+    // the repaint only draws cells that end up different.
+    clear();
 }
 
-void DebugTerminalWindow::parse_data(const std::string &str) {
-    auto iter = token_iterator::begin(str);
-    auto end = token_iterator::end(str);
+void DebugTerminalWindow::parse_data(std::string_view str) {
+    tokens.scan(str);
+    auto iter = tokens.begin();
+    auto end = tokens.end();
     while(iter!=end) {
-        std::cout << "got data token "<<*iter<<std::endl;
+        DEBUG_TRACE("got data token "<<*iter<<std::endl);
         switch(iter.classify()) {
         case token_iterator::TOKEN_NUMBER:
             putChar(iter.get_int());
             break;
         case token_iterator::TOKEN_STRING:
-            for (char c : iter.get_string()) {
-                putChar(c);
-            }
+            putString(iter.get_string());
             break;
         case token_iterator::TOKEN_SYMBOL: {
             auto symbol = iter.get_symbol();
             if (try_parse_common_data_sym(symbol,iter)) {
                 // ok
-            } else if (casecompare(symbol,"CLEAR")) {
-                clear();
+            } else if (auto sym = term_data_keywords.find(symbol)) {
+                switch (*sym) {
+                case TermDataSym::CLEAR:
+                    clear();
+                    break;
+                }
             } else {
                 throw token_error("Unhandled symbol \""s+std::string(symbol)+"\" in terminal data");
             }
@@ -241,13 +453,252 @@ void DebugTerminalWindow::parse_data(const std::string &str) {
     }
 }
 
+// Follows the cursor the way putChar and putRun move it, on the assumption that the line
+// doesn't start in the middle of a cursor positioning code
+LineEffect DebugTerminalWindow::data_effect(std::string_view str) {
+    LineEffect effect;
+    int x = 0, y = 0;
+    wchar_t special = 0;
+    bool first = true, drawn = false, lateColors = false, scrolls = false;
+    effect.keepsColors = true;
+    auto newLine = [&]() {
+        if (y >= termDim.rows-1) scrolls = true;
+        else y++;
+        x = 0;
+    };
+    auto shape = [&](int32_t val) {effect.shape.append((const char *)&val,sizeof(val));};
+    auto put = [&](wchar_t c) {
+        wchar_t thisSpecial = 0;
+        if (special) {
+            // Goes in as it is, it decides where the rest ends up
+            if (special == 2) x = std::clamp(int(c),0,termDim.cols-1);
+            else y = std::clamp(int(c),0,termDim.rows-1);
+            shape(c);
+        } else {
+            switch (c) {
+            case 0:
+                effect.wipes = first;
+                drawn = true; // With the current colors
+                x = y = 0;
+                break;
+            case 1: x = y = 0; break;
+            case 2 ... 3: thisSpecial = c; break;
+            case 4 ... 7:
+                effect.keepsColors = false;
+                if (drawn) lateColors = true;
+                break;
+            case 8:
+                if (--x < 0) {
+                    x = 0;
+                    if (y>0) --y;
+                }
+                break;
+            case 9: x = std::clamp((x+8)&~7,0,termDim.cols-1); break;
+            case 10: case 13: newLine(); break;
+            case 11 ... 12: case 14 ... 31: break;
+            default:
+                if (x >= termDim.cols) newLine();
+                x++;
+                drawn = true;
+                c = ' '; // Which character doesn't matter for where it goes
+                break;
+            }
+            if (first) effect.placed = c <= 1;
+            first = false;
+            shape(c);
+        }
+        special = thisSpecial;
+    };
+
+    tokens.scan(str);
+    for (auto iter = tokens.begin(), end = tokens.end();iter!=end;) {
+        switch (iter.classify()) {
+        case token_iterator::TOKEN_NUMBER:
+            put(iter.get_int());
+            break;
+        case token_iterator::TOKEN_STRING: {
+            auto text = iter.get_string();
+            if (text.empty()) break;
+            if (special) {
+                put(uint8_t(text[0]));
+                text.remove_prefix(1);
+            }
+            // Control codes in strings aren't worth following
+            for (char c : text) if (uint8_t(c) < 32) return {};
+            int len = text.size();
+            if (len) {
+                if (first) effect.placed = false;
+                first = false;
+                drawn = true;
+                shape(-1);
+                shape(len);
+            }
+            while (len > 0) {
+                if (x >= termDim.cols) newLine();
+                int count = std::min(len,termDim.cols-x);
+                x += count;
+                len -= count;
+            }
+        } break;
+        default:
+            return {}; // Commands (CLEAR, SAVE...) and anything erroneous
+        }
+    }
+    effect.known = true;
+    effect.settled = !special;
+    effect.placed = effect.placed && !scrolls && !lateColors;
+    return effect;
+}
+
 
 bool MainTerminalWindow::handleWindowEvent(SDL_Event &ev) {
     if (ev.window.event == SDL_WINDOWEVENT_RESIZED) {
         std::cout << "Window resized to " << ev.window.data1 << " x " << ev.window.data2 << std::endl;
         Dimension glyphDims = fnt.getGlyphDims();
         TerminalDimension newSize = {.cols=ev.window.data1/glyphDims.width,.rows=ev.window.data2/glyphDims.height};
-        if (newSize.cols > 0 && newSize.rows > 0 && newSize != termDim) resize(newSize);
+        if (newSize.cols > 0 && newSize.rows > 0 && newSize != termDim) reflow(newSize);
         return true;
     } else return false;
 };
+
+bool MainTerminalWindow::handleInputEvent(SDL_Event &ev) {
+    switch (ev.type) {
+    case SDL_MOUSEWHEEL:
+        scrollView(ev.wheel.y*3);
+        return true;
+    case SDL_KEYDOWN:
+        switch (ev.key.keysym.sym) {
+        case SDLK_PAGEUP:   scrollView(termDim.rows-1); return true;
+        case SDLK_PAGEDOWN: scrollView(-(termDim.rows-1)); return true;
+        case SDLK_HOME:     scrollView(history.size()); return true;
+        case SDLK_END:      scrollView(-viewOffset); return true;
+        default: return false;
+        }
+    default: return false;
+    }
+}
+
+void MainTerminalWindow::scrollView(int rows) {
+    int newOffset = std::clamp(viewOffset+rows,0,int(history.size()));
+    if (newOffset != viewOffset) {
+        viewOffset = newOffset;
+        allDirty();
+    }
+}
+
+void MainTerminalWindow::scrolledOff(RowView cells, bool wrapped) {
+    history.push(cells.chars,cells.attrs,termDim.cols,wrapped,palette,blankAttr());
+    // Keep the view where it is while scrolled back
+    if (viewOffset) viewOffset = std::min(viewOffset+1,int(history.size()));
+}
+
+TerminalWindow::RowView MainTerminalWindow::displayRow(int y) {
+    int histRow = int(history.size()) - viewOffset + y;
+    if (histRow >= int(history.size())) return TerminalWindow::displayRow(histRow-history.size());
+
+    viewChars.resize(termDim.cols*termDim.rows);
+    viewAttrs.resize(termDim.cols*termDim.rows);
+    uint16_t *chars = &viewChars[y*termDim.cols];
+    uint8_t *attrs = &viewAttrs[y*termDim.cols];
+    int stored = history.decode(histRow,chars,attrs,termDim.cols,[this](SDL_Color fg, SDL_Color bg) {return attrFor(fg,bg);});
+    std::fill(chars+stored,chars+termDim.cols,' ');
+    memset(attrs+stored,blankAttr(),termDim.cols-stored);
+    return {chars,attrs};
+}
+
+bool MainTerminalWindow::prepare() {
+    // The scrolled back view doesn't move along with new lines, so no pixel scrolling
+    if (viewOffset && dirty) allDirty();
+    return TerminalWindow::prepare();
+}
+
+// Re-wraps the history and the screen contents to a new width
+void MainTerminalWindow::reflow(TerminalDimension newdim) {
+    Scrollback rewrapped(history.getLimit());
+    uint8_t blank = blankAttr();
+    Scrollback::AttrMapper mapAttr = [this](SDL_Color fg, SDL_Color bg) {return attrFor(fg,bg);};
+    std::vector<uint16_t> lineChars, cellChars(std::max(termDim.cols,newdim.cols));
+    std::vector<uint8_t> lineAttrs, cellAttrs(cellChars.size());
+    size_t totalRows = 0, cursorRow = 0;
+    int newCursorX = 0;
+    bool haveCursor = false;
+    size_t cursorOff = 0;
+
+    auto emitLine = [&]() {
+        if (haveCursor && cursorOff > lineChars.size()) {
+            lineChars.resize(cursorOff,' ');
+            lineAttrs.resize(cursorOff,blank);
+        }
+        size_t count = std::max<size_t>(1,(lineChars.size()+newdim.cols-1)/newdim.cols);
+        if (haveCursor) {
+            size_t r = std::min(cursorOff/newdim.cols,count-1);
+            cursorRow = totalRows+r;
+            newCursorX = cursorOff-r*newdim.cols;
+            haveCursor = false;
+        }
+        for (size_t i=0;i<count;i++) {
+            size_t start = std::min<size_t>(i*newdim.cols,lineChars.size());
+            int len = std::min<size_t>(newdim.cols,lineChars.size()-start);
+            rewrapped.push(lineChars.data()+start,lineAttrs.data()+start,len,i+1<count,palette,blank);
+        }
+        totalRows += count;
+        lineChars.clear();
+        lineAttrs.clear();
+    };
+
+    for (size_t i=0;i<history.size();i++) {
+        bool wrapped;
+        int stored = history.decode(i,cellChars.data(),cellAttrs.data(),termDim.cols,mapAttr,&wrapped);
+        lineChars.insert(lineChars.end(),cellChars.begin(),cellChars.begin()+stored);
+        lineAttrs.insert(lineAttrs.end(),cellAttrs.begin(),cellAttrs.begin()+stored);
+        if (!wrapped) emitLine();
+    }
+    history.clear();
+
+    // Everything down to the cursor or the last non-blank row
+    int lastRow = cursorY;
+    for (int y=cursorY+1;y<termDim.rows;y++) {
+        const uint16_t *chars = rowChars(y);
+        if (std::any_of(chars,chars+termDim.cols,[](uint16_t ch){return ch != ' ';})) lastRow = y;
+    }
+    for (int y=0;y<=lastRow;y++) {
+        const uint16_t *chars = rowChars(y);
+        const uint8_t *attrs = rowAttrs(y);
+        bool wrapped = rowWrapped(y) && y < lastRow;
+        int count = termDim.cols;
+        if (!wrapped) while (count > 0 && chars[count-1] == ' ') count--;
+        if (y == cursorY) {
+            haveCursor = true;
+            cursorOff = lineChars.size()+cursorX;
+        }
+        lineChars.insert(lineChars.end(),chars,chars+count);
+        lineAttrs.insert(lineAttrs.end(),attrs,attrs+count);
+        if (!wrapped) emitLine();
+    }
+
+    // Trailing rows that wouldn't fit below the cursor are dropped
+    size_t rowsAfterCursor = totalRows-1-cursorRow;
+    while (rowsAfterCursor > size_t(newdim.rows-1) && rewrapped.size()) {
+        rewrapped.popBack(cellChars.data(),cellAttrs.data(),newdim.cols,mapAttr);
+        rowsAfterCursor--;
+    }
+
+    resize(newdim);
+    rowOffset = 0;
+    int onScreen = std::min<int>(newdim.rows,rewrapped.size());
+    for (int y=0;y<termDim.rows;y++) {
+        fillCells(y,0,termDim.cols,' ',blank);
+        rowWrapped(y) = 0;
+    }
+    for (int y=onScreen-1;y>=0;y--) {
+        bool wrapped;
+        rewrapped.popBack(rowChars(y),rowAttrs(y),termDim.cols,mapAttr,&wrapped);
+        rowWrapped(y) = wrapped;
+    }
+    history = std::move(rewrapped);
+
+    cursorY = std::clamp(onScreen-1-int(rowsAfterCursor),0,termDim.rows-1);
+    cursorX = std::clamp(newCursorX,0,termDim.cols);
+    viewOffset = 0;
+    allDirty();
+}
@@ -1,7 +1,10 @@
 #pragma once
 #include "main.hpp"
 #include "font.hpp"
+#include "scrollback.hpp"
 #include <algorithm>
+#include <array>
+#include <bitset>
 
 struct TerminalDimension {
     int cols,rows;
@@ -17,16 +20,87 @@ struct termchar_t {
     SDL_Color fg,bg;
 };
 
+struct ColorPair {
+    SDL_Color fg,bg;
+};
+
+// Interns fg/bg color pairs, so a cell only needs a one byte attribute
+class CellPalette {
+    private:
+        std::vector<ColorPair> pairs;
+        int last = -1; // Most lookups are for the same colors as the one before
+        static bool same(const SDL_Color &a, const SDL_Color &b) {return a.r == b.r && a.g == b.g && a.b == b.b;};
+    public:
+        static constexpr size_t MAX_PAIRS = 256;
+        // Index of the pair, added if it's new. -1 once the palette is full.
+        int find(SDL_Color fg, SDL_Color bg) {
+            if (last >= 0 && same(pairs[last].fg,fg) && same(pairs[last].bg,bg)) return last;
+            for (size_t i=0;i<pairs.size();i++) {
+                if (same(pairs[i].fg,fg) && same(pairs[i].bg,bg)) return last = i;
+            }
+            if (pairs.size() >= MAX_PAIRS) return -1;
+            pairs.push_back({fg,bg});
+            return last = pairs.size()-1;
+        };
+        const ColorPair &operator[](uint8_t attr) const {return pairs[attr];};
+        size_t size() const {return pairs.size();};
+        // Drops the unused pairs, returns where each old attribute moved to
+        std::array<uint8_t,MAX_PAIRS> compact(const std::bitset<MAX_PAIRS> &used);
+};
+
 class TerminalWindow : public virtual AppWindow {
     protected:
         TerminalDimension termDim;
-        termchar_t *grid;
+        // The grid is kept as separate arrays of characters and attributes (palette indices).
+        // Rows are a ring buffer, logical row 0 lives at physical row rowOffset
+        std::vector<uint16_t> gridChars;
+        std::vector<uint8_t> gridAttrs;
+        CellPalette palette;
+        std::vector<uint8_t> wrapFlags; // Per physical row, set if the line continues on the next row
+        int rowOffset = 0;
+        int pendingScroll = 0; // Rows scrolled since the last repaint
+        int physRow(int y) {
+            int phys = y+rowOffset;
+            return phys >= termDim.rows ? phys - termDim.rows : phys;
+        }
+        uint16_t *rowChars(int y) {return &gridChars[physRow(y)*termDim.cols];};
+        uint8_t *rowAttrs(int y) {return &gridAttrs[physRow(y)*termDim.cols];};
+        uint8_t &rowWrapped(int y) {return wrapFlags[physRow(y)];};
+        struct RowView {
+            const uint16_t *chars;
+            const uint8_t *attrs;
+        };
+        // What repaint shows in row y, normally just the grid
+        virtual RowView displayRow(int y) {return {rowChars(y),rowAttrs(y)};};
+        // Called with the top row right before it scrolls away
+        virtual void scrolledOff(RowView cells, bool wrapped) {};
+        // Palette index for the colors. Might compact the palette, which only
+        // remaps the grid, so don't hold on to attributes across calls.
+        uint8_t attrFor(SDL_Color fg, SDL_Color bg);
+        void compactPalette();
+        uint8_t currentAttr() {return attrFor(current_fg,current_bg);};
+        uint8_t blankAttr() {return attrFor(current_fg,global_bg);};
+        void fillCells(int y, int xmin, int xmax, uint16_t ch, uint8_t attr) {
+            std::fill(rowChars(y)+xmin,rowChars(y)+xmax,ch);
+            memset(rowAttrs(y)+xmin,attr,xmax-xmin);
+        };
         FontCheckout fnt = loadFont();
         virtual FontCheckout loadFont() {return font_cache.get({.name=default_typeface,.size=16});};
-        int dirtyXMin, dirtyYMin, dirtyXMax, dirtyYMax;
-        void allDirty() {dirty = true; dirtyXMin = INT_MIN, dirtyYMin = INT_MIN, dirtyXMax = INT_MAX, dirtyYMax = INT_MAX;};
-        void allClean() {dirty = false; dirtyXMin = INT_MAX, dirtyYMin = INT_MAX, dirtyXMax = INT_MIN, dirtyYMax = INT_MIN;};
-        void newLine();
+        // One bit per cell, by physical row so scrolling doesn't move them
+        std::vector<uint64_t> dirtyBits;
+        int dirtyWords = 0; // Per row
+        bool fullRepaint = true;
+        void allDirty() {dirty = true; pendingScroll = 0; fullRepaint = true;};
+        void allClean() {dirty = false; fullRepaint = false; std::fill(dirtyBits.begin(),dirtyBits.end(),0);};
+        // What the canvas shows right now, by screen row. Dirty cells that still match get skipped.
+        // Attributes compare fine since the palette never has the same pair twice.
+        std::vector<uint16_t> shownChars;
+        std::vector<uint8_t> shownAttrs;
+        bool shownValid = false; // Cleared when the canvas or the font changes
+        void invalidateShown() {shownValid = false; allDirty();};
+        void markDirty(int xmin,int ymin,int xmax,int ymax);
+        void newLine(bool wrap = false);
+        void putRun(const char *str,int len);
 
         // Terminal state
         int cursorX=0,cursorY=0;
@@ -38,27 +112,29 @@ class TerminalWindow : public virtual AppWindow {
         virtual uint32_t getWindowFlags() {
             return 0;
         };
-        virtual void repaint();
+        virtual bool prepare();
+        virtual void render();
         termchar_t getCharAt(int x,int y) {
             if (x>=termDim.cols||y>=termDim.rows) throw std::out_of_range("Coordinates out of range");
-            if (!grid) return {.ch='!',.fg=current_fg,.bg=current_bg};
-            return grid[x+y*termDim.cols];
+            if (gridChars.empty()) return {.ch='!',.fg=current_fg,.bg=current_bg};
+            const ColorPair &colors = palette[rowAttrs(y)[x]];
+            return {.ch=rowChars(y)[x],.fg=colors.fg,.bg=colors.bg};
         }
         void setCharAt(int x,int y,termchar_t c) {
             if (x>=termDim.cols||y>=termDim.rows) throw std::out_of_range("Coordinates out of range");
-            if (!grid) throw std::runtime_error("grid is null");
-            grid[x+y*termDim.cols] = c;
-            dirty = true;
-            dirtyXMin = std::min(dirtyXMin,x);
-            dirtyXMax = std::max(dirtyXMax,x);
-            dirtyYMin = std::min(dirtyYMin,y);
-            dirtyYMax = std::max(dirtyYMax,y);
+            if (gridChars.empty()) throw std::runtime_error("grid is null");
+            uint8_t attr = attrFor(c.fg,c.bg);
+            if (rowChars(y)[x] == c.ch && rowAttrs(y)[x] == attr) return; // Already there (and dirty if it needs to be)
+            rowChars(y)[x] = c.ch;
+            rowAttrs(y)[x] = attr;
+            markDirty(x,y,x,y);
         }
         void setCharAt(int x,int y,wchar_t c) {
             setCharAt(x,y,{.ch=c,.fg=current_fg,.bg=current_bg});
         }
         void clear();
         void putChar(wchar_t c);
+        void putString(std::string_view str);
         void resize(TerminalDimension termDim);
         virtual void selectColors(int i) = 0;
         TerminalWindow();
@@ -67,26 +143,53 @@ class TerminalWindow : public virtual AppWindow {
 
 class MainTerminalWindow : public TerminalWindow {
     protected:
+        Scrollback history;
+        int viewOffset = 0; // How many rows the view is scrolled back into history
+        // Decoded history rows for display
+        std::vector<uint16_t> viewChars;
+        std::vector<uint8_t> viewAttrs;
+        std::string title;
+
+        virtual RowView displayRow(int y);
+        virtual void scrolledOff(RowView cells, bool wrapped);
+        void scrollView(int rows);
+        void reflow(TerminalDimension newdim);
     public:
         virtual void selectColors(int i) {
             // No-Op
         };
-        virtual const char *get_title() {return "DEBUG Output";};
-        MainTerminalWindow();
+        virtual const char *get_title() {return title.c_str();};
+        MainTerminalWindow(std::string title = "DEBUG Output");
         virtual uint32_t getWindowFlags() {return TerminalWindow::getWindowFlags()|SDL_WINDOW_RESIZABLE;};
         virtual bool handleWindowEvent(SDL_Event &ev);
+        virtual bool handleInputEvent(SDL_Event &ev);
+        virtual bool prepare();
+        void setScrollbackLimit(size_t bytes) {history.setLimit(bytes); viewOffset = std::min<int>(viewOffset,history.size());};
 };
 
 class DebugTerminalWindow : public DebugWindow, TerminalWindow {
     protected:
+        // Everything a TERM setup line sets. Firmware tends to send the same setup over and over,
+        // so it gets compared against the current one and only the differences get applied.
+        struct Config {
+            TerminalDimension size = {.cols=40,.rows=20};
+            int textSize = 16;
+            SDL_Color backColor = {0,0,0};
+            std::array<SDL_Color,8> colors;
+        };
+        Config config;
+        void applyConfig(const Config &next);
+
         FontProperties using_font = {.name=default_typeface,.size=16};
         virtual FontCheckout loadFont() {return font_cache.get(using_font);};
-        virtual void parse_setup(const std::string &str);
-        virtual void parse_data(const std::string &str);
+        virtual void parse_setup(std::string_view str);
+        virtual void parse_data(std::string_view str);
+        virtual LineEffect data_effect(std::string_view str);
+        virtual bool data_settled() {return !lastSpecial;};
         uint8_t last_selected_colors;
     public:
         virtual void selectColors(int i) {
-            i = std::clamp(i,0,4);
+            i = std::clamp(i,0,3);
             last_selected_colors = i;
             current_fg = term_colors[i*2];
             current_bg = term_colors[i*2+1];
@@ -0,0 +1,233 @@
+#include "main.hpp"
+#include "keywords.hpp"
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Sets a bit for every space, 16 bytes at a time. Everything past the end counts as space,
+// including a whole extra word, so looking for the end of a token always finds one.
+void token_line::markSpaces(std::string_view str) {
+    size_t words = str.size()/64 + 1;
+    spaceBits.assign(words+1,0);
+    spaceBits[words] = ~0ull;
+    uint64_t *bits = spaceBits.data();
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i spaces = _mm_set1_epi8(' ');
+    for (;i+16 <= str.size();i+=16) {
+        uint64_t mask = uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(str.data()+i)),spaces)));
+        bits[i>>6] |= mask << (i&63);
+    }
+    if (i < str.size()) {
+        // Rest of the line padded out with spaces
+        char tail[16];
+        memset(tail,' ',16);
+        memcpy(tail,str.data()+i,str.size()-i);
+        uint64_t mask = uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)tail),spaces)));
+        bits[i>>6] |= mask << (i&63);
+    }
+#else
+    for (;i<str.size();i++) bits[i>>6] |= uint64_t(str[i] == ' ') << (i&63);
+#endif
+    bits[str.size()>>6] |= ~0ull << (str.size()&63);
+}
+
+// First position at or after pos that is (or with space false, isn't) a space
+size_t token_line::findBit(size_t pos, bool space) const {
+    uint64_t flip = space ? 0 : ~0ull;
+    size_t w = pos>>6;
+    uint64_t bits = (spaceBits[w]^flip) & (~0ull << (pos&63));
+    while (!bits) {
+        if (++w == spaceBits.size()) return SIZE_MAX;
+        bits = spaceBits[w]^flip;
+    }
+    return (w<<6) + __builtin_ctzll(bits);
+}
+
+// Up to eight decimal digits in one go, little endian only (that's everything SDL runs on nowadays).
+// Needs 8 readable bytes at p, but only the first count (1..8) are looked at.
+static bool decode_8_digits(const char *p, size_t count, uint32_t &val) {
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    if (count-1 >= 8) return false; // Shifting by 64 below would be undefined
+    uint64_t chunk;
+    memcpy(&chunk,p,8);
+    chunk -= 0x3030303030303030ull;
+    uint64_t used = ~0ull >> ((8-count)*8);
+    // A byte is a digit if it's still 0..9 after taking away '0'
+    if (((chunk + 0x7676767676767676ull) | chunk) & 0x8080808080808080ull & used) return false;
+    chunk = (chunk & used) << ((8-count)*8); // Leading zeros for the unused bytes
+    chunk = chunk*10 + (chunk>>8);
+    chunk = (((chunk & 0x000000FF000000FFull) * (100 + (1000000ull<<32))) + (((chunk>>16) & 0x000000FF000000FFull) * (1 + (10000ull<<32)))) >> 32;
+    val = uint32_t(chunk);
+    return true;
+#else
+    return false;
+#endif
+}
+
+template<uint base>
+static bool decode_digits(const char *p, const char *end, uint32_t &val) {
+    bool digits = false;
+    for (;p<end;p++) {
+        uint digit = uint8_t(*p) - '0';
+        if (base == 16 && digit > 9) digit = (uint8_t(*p)|0x20) - 'a' + 10;
+        if (digit >= base) {
+            if (*p == '_') continue;
+            return false;
+        }
+        val = val*base + digit;
+        digits = true;
+    }
+    return digits;
+}
+
+// False if it isn't a number after all. Wraps around at 32 bits, like the P2 would.
+// limit is where the line ends, for reading past the end of the token.
+static bool decode_number(std::string_view str, const char *limit, int &out) {
+    const char *p = str.data(), *end = p+str.size();
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    uint32_t val = 0;
+    bool ok;
+    if (p < end && *p == '$') ok = decode_digits<16>(p+1,end,val);
+    else if (p+1 < end && p[0] == '%' && p[1] == '%') ok = decode_digits<4>(p+2,end,val);
+    else if (p < end && *p == '%') ok = decode_digits<2>(p+1,end,val);
+    else if (end > p && end-p <= 8 && limit-p >= 8 && decode_8_digits(p,end-p,val)) ok = true; // Never empty, a bare sign isn't a number
+    else ok = decode_digits<10>(p,end,val);
+    if (!ok) return false;
+    out = int(negative ? 0u-val : val);
+    return true;
+}
+
+// Anything that isn't a string
+static inline void classify_word(token_iterator::token &tok, const char *p, size_t len, const char *limit) {
+    tok.text = {p,len};
+    tok.kind = token_iterator::TOKEN_ERROR;
+    tok.value = 0;
+    switch (*p) {
+    case 'a' ... 'z': case 'A' ... 'Z':
+        tok.kind = token_iterator::TOKEN_SYMBOL;
+        break;
+    case '0' ... '9': case '-': case '+': case '$': case '%':
+        if (decode_number(tok.text,limit,tok.value)) tok.kind = token_iterator::TOKEN_NUMBER;
+        break;
+    }
+}
+
+void token_line::scan(std::string_view str) {
+    tokens.clear();
+    markSpaces(str);
+    const char *line = str.data(), *limit = line+str.size();
+    if (str.empty() || !memchr(line,'\'',str.size())) {
+        // No strings (the usual case for lots of numbers), so every edge between spaces
+        // and not-spaces is a token boundary, starts and ends taking turns.
+        // Those come straight out of the bits without looking at the line again.
+        size_t words = (str.size()>>6)+1;
+        if (bounds.size() < words*64) bounds.resize(words*64);
+        uint32_t *out = bounds.data(), *next = out;
+        uint64_t carry = 1; // Start of the line counts as space
+        for (size_t w=0;w<words;w++) {
+            uint64_t edges = spaceBits[w] ^ (spaceBits[w]<<1 | carry);
+            carry = spaceBits[w]>>63;
+            while (edges) {
+                *next++ = (w<<6) + __builtin_ctzll(edges);
+                edges &= edges-1;
+            }
+        }
+        tokens.resize((next-out)/2);
+        for (auto &tok : tokens) {
+            classify_word(tok,line+out[0],out[1]-out[0],limit);
+            out += 2;
+        }
+    } else {
+        size_t pos = 0;
+        while ((pos = findBit(pos,false)) < str.size()) {
+            const char *p = line+pos;
+            if (*p == '\'') {
+                auto close = (const char *)memchr(p+1,'\'',limit-p-1);
+                if (!close) {
+                    // Unterminated, so the rest of the line is junk
+                    tokens.push_back({.text={p,size_t(limit-p)},.kind=token_iterator::TOKEN_ERROR,.value=0});
+                    break;
+                }
+                tokens.push_back({.text={p,size_t(close+1-p)},.kind=token_iterator::TOKEN_STRING,.value=0});
+                pos = close+1-line;
+                continue;
+            }
+            size_t end = findBit(pos,true);
+            classify_word(tokens.emplace_back(),p,end-pos,limit);
+            pos = end;
+        }
+    }
+    tokens.push_back({.text={limit,0},.kind=token_iterator::TOKEN_END,.value=0});
+}
+
+token_iterator::value_type token_iterator::get_symbol(const char *desc) {
+    expect(TOKEN_SYMBOL,desc);
+    value_type sview = tok->text;
+    (*this)++;
+    return sview;
+}
+
+token_iterator::value_type token_iterator::get_string(const char *desc) {
+    expect(TOKEN_STRING,desc);
+    value_type sview = tok->text;
+    sview.remove_prefix(1); // Get rid of quotes
+    sview.remove_suffix(1);
+    (*this)++;
+    return sview;
+}
+
+struct ColorSpec {
+    SDL_Color base;
+    bool need_intensity;
+};
+
+static constexpr auto color_keywords = make_keyword_table<ColorSpec>({
+    {"WHITE",  {{255,255,255},false}},
+    {"BLACK",  {{0,0,0},false}},
+    {"GREY",   {{255,255,255},true}},
+    {"YELLOW", {{255,255,0},true}},
+    {"MAGENTA",{{255,0,255},true}},
+    {"RED",    {{255,0,0},true}},
+    {"CYAN",   {{0,255,255},true}},
+    {"GREEN",  {{0,255,0},true}},
+    {"BLUE",   {{0,0,255},true}},
+    {"ORANGE", {{255,127,0},true}},
+});
+
+bool token_iterator::is_color(const char *desc) const {
+    switch (classify()) {
+    case TOKEN_NUMBER:  return true; // Presume this is an RGB color
+    case TOKEN_SYMBOL:  return color_keywords.contains(**this);
+    default: return false;
+    }
+}
+
+
+SDL_Color token_iterator::get_color(const char *desc) {
+    switch (classify()) {
+    case TOKEN_NUMBER: {// Presume this is an RGB color
+        int c = get_int();
+        return {.r=c&255,.g=(c>>8)&255,.b=(c>>16)&255};
+    } break;
+    case TOKEN_SYMBOL: {
+        auto symbol = get_symbol();
+        auto spec = color_keywords.find(symbol);
+        if (!spec) {
+            throw token_error("Unknown color \""s+std::string(symbol)+"\"");
+        }
+        SDL_Color basecol = spec->base;
+        if (spec->need_intensity) {
+            short i = classify() == TOKEN_NUMBER ? std::clamp(get_int(),0,15) : 8;
+            short lighten = (i-8)<<5;
+            if (lighten>0) return {std::min(255,basecol.r+lighten),std::min(255,basecol.g+lighten),std::min(255,basecol.b+lighten)};
+            else return {(basecol.r*i)>>3,(basecol.g*i)>>3,(basecol.b*i)>>3};
+        } else return basecol;
+    }
+    default:
+        throw token_error("While "s+desc+": Expected NUMBER or SYMBOL");
+    }
+}
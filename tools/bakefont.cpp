@@ -0,0 +1,81 @@
+// Rasterizes a font at build time into a C++ source of constexpr glyph tables (see prebaked.hpp):
+//   bakefont OUTPUT.cpp NAME SIZE...
+// Goes through the regular FontCache, so the glyphs come out exactly like FreeType would draw them at runtime.
+#include "../font.hpp"
+#include <iostream>
+#include <cstdio>
+
+// Nothing's prebaked while baking
+const PrebakedFont *const prebaked_fonts = nullptr;
+const size_t prebaked_font_count = 0;
+
+// Printable Latin-1, anything else is rare enough to leave to FreeType
+static constexpr uint16_t bake_first = 32, bake_count = 224;
+
+// Zero runs become a 0 byte and the run length
+static void pack_glyph(std::vector<uint8_t> &out, const uint8_t *coverage, size_t len) {
+    for (size_t i=0;i<len;) {
+        if (coverage[i]) {
+            out.push_back(coverage[i++]);
+            continue;
+        }
+        size_t run = 0;
+        while (i+run < len && run < 255 && !coverage[i+run]) run++;
+        out.push_back(0);
+        out.push_back(run);
+        i += run;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " OUTPUT.cpp NAME SIZE...\n";
+        return 1;
+    }
+    std::string name = argv[2];
+    std::string ident = name;
+    for (char &c : ident) if (!isalnum(uint8_t(c))) c = '_';
+
+    FILE *out = fopen(argv[1],"w");
+    if (!out) {
+        std::cerr << "Can't open " << argv[1] << "\n";
+        return 1;
+    }
+    try {
+        if (TTF_Init()) throw ttf_error("SDL2_TTF init error");
+        fprintf(out,"// Generated by tools/bakefont.cpp from %s.ttf, don't edit\n",name.c_str());
+        fprintf(out,"#include \"prebaked.hpp\"\n\n");
+
+        std::string table;
+        for (int i=3;i<argc;i++) {
+            int size = atoi(argv[i]);
+            FontCheckout fnt = font_cache.get({.name=name,.size=size});
+            Dimension cell = fnt.getGlyphDims();
+            std::vector<uint8_t> packed;
+            for (uint16_t ch=bake_first;ch<bake_first+bake_count;ch++) {
+                pack_glyph(packed,fnt.getGlyph(ch),size_t(cell.width)*cell.height);
+            }
+
+            std::string array = "glyphs_"+ident+"_"+std::to_string(size);
+            fprintf(out,"static constexpr uint8_t %s[] = {",array.c_str());
+            for (size_t b=0;b<packed.size();b++) fprintf(out,"%s%u,",b%32 ? "" : "\n    ",packed[b]);
+            fprintf(out,"\n};\n\n");
+            table += "    {.name=\""+name+"\",.size="+std::to_string(size)+",.cell={"+std::to_string(cell.width)+","+std::to_string(cell.height)+"},"
+                     ".first="+std::to_string(bake_first)+",.count="+std::to_string(bake_count)+",.data="+array+",.dataSize=sizeof("+array+")},\n";
+        }
+
+        fprintf(out,"static constexpr PrebakedFont fonts[] = {\n%s};\n\n",table.c_str());
+        fprintf(out,"const PrebakedFont *const prebaked_fonts = fonts;\n");
+        fprintf(out,"const size_t prebaked_font_count = sizeof(fonts)/sizeof(fonts[0]);\n");
+    } catch (std::exception &e) {
+        std::cerr << e.what() << "\n";
+        fclose(out);
+        remove(argv[1]); // Don't leave half a file for rake to trip over
+        return 1;
+    }
+    if (fclose(out)) {
+        std::cerr << "Failed to write " << argv[1] << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+// Expands a window recording (RECORD/STOP) into one PNG per frame,
+// plus a list of when each frame was shown.
+#include "../main.hpp"
+#include "../recording.hpp"
+#include "../snapshot.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " RECORDING.p2rec [OUTPUT_PREFIX]\n";
+        return 1;
+    }
+    std::string path = argv[1];
+    std::string prefix = argc > 2 ? argv[2] : path.substr(0,path.rfind(".p2rec"));
+
+    try {
+        RecordingReader reader(path);
+        RecordedFrame frame;
+        std::vector<uint32_t> image;
+        int width = 0, height = 0;
+        size_t count = 0;
+        std::ofstream times(prefix+"_times.txt");
+        while (reader.next(frame)) {
+            if (frame.width != width || frame.height != height) {
+                width = frame.width;
+                height = frame.height;
+                image.assign(size_t(width)*height,0xFF000000);
+            }
+            // Paste the changed rects over the previous frame
+            const uint32_t *src = frame.pixels.data();
+            for (auto &rect : frame.rects) {
+                for (int y=0;y<rect.h;y++) {
+                    std::copy(src,src+rect.w,&image[size_t(rect.y+y)*width+rect.x]);
+                    src += rect.w;
+                }
+            }
+
+            std::ostringstream name;
+            name << prefix << "_" << std::setw(6) << std::setfill('0') << count++ << ".png";
+            auto png = encode_png(image.data(),width,height);
+            std::ofstream out(name.str(),std::ios::binary);
+            out.write((const char *)png.data(),png.size());
+            if (!out) throw std::runtime_error("Failed to write "+name.str());
+            times << name.str() << " " << std::fixed << std::setprecision(3) << frame.time_us/1000.0 << " ms\n";
+        }
+        std::cout << count << " frames written to " << prefix << "_*.png\n";
+    } catch (std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,225 @@
+#include "main.hpp"
+#include "keywords.hpp"
+#include "snapshot.hpp"
+#include "recording.hpp"
+#include <iostream>
+
+
+DebugWindow *WindowRegistry::insert(std::string_view name, std::unique_ptr<DebugWindow> win, uint32_t ns) {
+    erase(name,ns);
+    auto entry = std::make_unique<Entry>();
+    entry->name = name;
+    entry->ns = ns;
+    entry->win = std::move(win);
+    DebugWindow *ptr = entry->win.get();
+    Key key = {ns,entry->name};
+    byName.emplace(key,std::move(entry));
+    return ptr;
+}
+
+void WindowRegistry::erase(std::string_view name, uint32_t ns) {
+    auto iter = byName.find({ns,name});
+    if (iter != byName.end()) erase(iter);
+}
+
+WindowRegistry::iterator WindowRegistry::erase(iterator iter) {
+    if (iter->second->id) byID.erase(iter->second->id);
+    return byName.erase(iter);
+}
+
+WindowRegistry::Entry *WindowRegistry::indexByID(uint32_t id) {
+    // SDL windows get created lazily on first repaint, so pick up any new ones
+    Entry *found = nullptr;
+    for (auto &[name,entry] : byName) {
+        if (!entry->id && (entry->id = entry->win->getWindowID())) byID[entry->id] = entry.get();
+        if (entry->id == id) found = entry.get();
+    }
+    return found;
+}
+
+DebugWindow *WindowRegistry::findByID(uint32_t id, std::string_view *name, uint32_t *ns) {
+    auto iter = byID.find(id);
+    Entry *entry = iter != byID.end() ? iter->second : indexByID(id);
+    if (!entry) return nullptr;
+    if (name) *name = entry->name;
+    if (ns) *ns = entry->ns;
+    return entry->win.get();
+}
+AppWindow::AppWindow() {
+    // Nothing to do here for now...
+}
+
+bool AppWindow::prepare() {
+    // Just make sure the window is set up
+    const char *title = get_title();
+    if (!handle) {
+        std::cout << "Window size: " << dim.width << ", " << dim.height << std::endl;
+        handle = SDL_CreateWindow(title,SDL_WINDOWPOS_UNDEFINED,SDL_WINDOWPOS_UNDEFINED,dim.width,dim.height,getWindowFlags());
+        if (!handle) throw sdl_error("Failed to create window \""s + title + "\"");
+    }
+    if (!strcmp(SDL_GetWindowTitle(handle),title)) SDL_SetWindowTitle(handle,title);
+    int w,h;
+    SDL_GetWindowSize(handle,&w,&h);
+    if (w != dim.width || h != dim.height) SDL_SetWindowSize(handle,dim.width,dim.height);
+
+    dirty = false;
+    forceRepaint = false;
+
+    if (canvas && canvas->w == dim.width && canvas->h == dim.height) return false;
+    // Same format as the window if possible, so presenting is just a copy
+    SDL_Surface *win_surf = SDL_GetWindowSurface(handle);
+    if (!win_surf) throw sdl_error("Failed to get window surface");
+    Uint32 format = win_surf->format->BytesPerPixel == 4 ? win_surf->format->format : SDL_PIXELFORMAT_ARGB8888;
+    if (canvas) SDL_FreeSurface(canvas);
+    canvas = SDL_CreateRGBSurfaceWithFormat(0,dim.width,dim.height,32,format);
+    if (!canvas) throw sdl_error("Failed to create canvas for \""s + title + "\"");
+    SDL_SetSurfaceBlendMode(canvas,SDL_BLENDMODE_NONE);
+    presentAll = true;
+    return true;
+}
+
+void AppWindow::present() {
+    SDL_Surface *win_surf = SDL_GetWindowSurface(handle);
+    if (!win_surf) throw sdl_error("Failed to get window surface");
+    // A new window surface (e.g. after a resize) starts out empty
+    if (win_surf != presentedSurface) presentAll = true;
+    if (!presentAll && presentRects.empty()) return; // Nothing changed on the canvas
+    if (presentAll) {
+        if (SDL_BlitSurface(canvas,nullptr,win_surf,nullptr)) throw sdl_error("Failed to present canvas");
+        SDL_UpdateWindowSurface(handle);
+    } else {
+        for (auto rect : presentRects) {
+            if (SDL_BlitSurface(canvas,&rect,win_surf,&rect)) throw sdl_error("Failed to present canvas");
+        }
+        SDL_UpdateWindowSurfaceRects(handle,presentRects.data(),presentRects.size());
+    }
+    presentedSurface = win_surf;
+    presentRects.clear();
+    presentAll = false;
+}
+
+AppWindow::~AppWindow() {
+    if (canvas) SDL_FreeSurface(canvas);
+    if (handle) SDL_DestroyWindow(handle);
+}
+enum class CommonSetupSym {POS,TITLE,UPDATE};
+static constexpr auto common_setup_keywords = make_keyword_table<CommonSetupSym>({
+    {"POS",CommonSetupSym::POS},
+    {"TITLE",CommonSetupSym::TITLE},
+    {"UPDATE",CommonSetupSym::UPDATE},
+});
+
+bool DebugWindow::try_parse_common_setup_sym(std::string_view symbol, token_iterator &iter) {
+    auto sym = common_setup_keywords.find(symbol);
+    if (!sym) return false;
+    switch (*sym) {
+    case CommonSetupSym::POS: {
+        int x = iter.get_int("Getting POS X");
+        int y = iter.get_int("Getting POS Y");
+        // TODO: actually handle this
+    } break;
+    case CommonSetupSym::TITLE:
+        title = iter.get_string("Getting TITLE");
+        dirty = true;
+        break;
+    case CommonSetupSym::UPDATE:
+        lazyRepaint = true;
+        break;
+    }
+
+    return true;
+}
+
+enum class CommonDataSym {CLOSE,UPDATE,SAVE,RECORD,STOP};
+static constexpr auto common_data_keywords = make_keyword_table<CommonDataSym>({
+    {"CLOSE",CommonDataSym::CLOSE},
+    {"UPDATE",CommonDataSym::UPDATE},
+    {"SAVE",CommonDataSym::SAVE},
+    {"RECORD",CommonDataSym::RECORD},
+    {"STOP",CommonDataSym::STOP},
+});
+
+// Files named by the firmware have to stay below the working directory
+static void check_output_path(std::string_view name) {
+    if (name.empty() || name[0] == '/') throw std::runtime_error("Output path mustn't be absolute");
+    if (name.find("..")!=name.npos) throw std::runtime_error("Output path mustn't contain \"..\"");
+}
+
+bool DebugWindow::try_parse_common_data_sym(std::string_view symbol, token_iterator &iter) {
+    auto sym = common_data_keywords.find(symbol);
+    if (!sym) return false;
+    switch (*sym) {
+    case CommonDataSym::CLOSE:
+        shouldClose = true;
+        break;
+    case CommonDataSym::UPDATE:
+        forceRepaint = true;
+        break;
+    case CommonDataSym::SAVE: {
+        bool window = iter.classify()==token_iterator::TOKEN_SYMBOL && casecompare(*iter,"WINDOW") && (++iter,true);
+        auto name = iter.get_string("Getting SAVE file name");
+        check_output_path(name);
+        repaint(); // Force repaint
+        // Only the copy happens here, compressing and writing is up to the snapshot thread
+        auto surface = get_save_surface(window);
+        try {
+            snapshot_writer.save(surface,std::string(name)+".png");
+        } catch (...) {
+            dispose_save_surface(surface);
+            throw;
+        }
+        dispose_save_surface(surface);
+    } break;
+    case CommonDataSym::RECORD: {
+        auto name = iter.get_string("Getting RECORD file name");
+        check_output_path(name);
+        recorder.reset();
+        recorder = std::make_unique<WindowRecorder>(std::string(name)+".p2rec");
+        presentAll = true; // Start off with a full frame
+        dirty = true;
+    } break;
+    case CommonDataSym::STOP:
+        // The writer thread finishes the file in its own time
+        if (recorder) std::cout << "Recorded " << recorder->getFrames() << " frames of \"" << title << "\" (" << recorder->getDropped() << " dropped)" << std::endl;
+        recorder.reset();
+        break;
+    }
+
+    return true;
+}
+
+SDL_Surface *DebugWindow::get_save_surface(bool window) {
+    // WINDOW takes the window surface as presented, otherwise it's the display area (the canvas).
+    // SDL can't see the title bar and borders, so they only differ when the window is bigger than the display.
+    auto surf = window && handle ? SDL_GetWindowSurface(handle) : canvas;
+    if (!surf) throw sdl_error("No canvas for screenshot");
+    if (SDL_LockSurface(surf)) throw sdl_error("Failed to get window surface for screenshot");;
+    return surf;
+}
+
+void DebugWindow::dispose_save_surface(SDL_Surface *surf) {
+    SDL_UnlockSurface(surf);
+}
+
+void DebugWindow::present() {
+    // Record what's about to be presented, the same rects that go to the screen
+    if (recorder && canvas && (presentAll || !presentRects.empty())) {
+        auto surface = get_save_surface(false);
+        try {
+            recorder->capture(surface,presentRects,presentAll);
+        } catch (...) {
+            dispose_save_surface(surface);
+            throw;
+        }
+        dispose_save_surface(surface);
+    }
+    AppWindow::present();
+}
+
+// Out of line for the recorder's sake, it's incomplete in main.hpp
+DebugWindow::DebugWindow(std::string title) : AppWindow(), title{title} {
+}
+
+DebugWindow::~DebugWindow() {
+}
+
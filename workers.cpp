@@ -0,0 +1,80 @@
+#include "workers.hpp"
+
+WorkerPool::WorkerPool(int count) {
+    mutex = SDL_CreateMutex();
+    wake = SDL_CreateCond();
+    done = SDL_CreateCond();
+    if (!mutex || !wake || !done) throw sdl_error("Failed to create worker pool");
+    for (int i=0;i<count;i++) {
+        SDL_Thread *thread = SDL_CreateThread(run_worker,"Render Worker",this);
+        if (!thread) throw sdl_error("Failed to create worker thread");
+        threads.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+        quit = true;
+        SDL_CondBroadcast(wake);
+    }
+    for (auto thread : threads) SDL_WaitThread(thread,nullptr);
+    SDL_DestroyCond(done);
+    SDL_DestroyCond(wake);
+    SDL_DestroyMutex(mutex);
+}
+
+int WorkerPool::run_worker(void *ptr) {
+    WorkerPool &pool = *(WorkerPool *)ptr;
+    uint64_t seen = 0;
+    SDL_LockMutex(pool.mutex);
+    for (;;) {
+        while (!pool.quit && pool.batch == seen) SDL_CondWait(pool.wake,pool.mutex);
+        if (pool.quit) break;
+        seen = pool.batch;
+        SDL_UnlockMutex(pool.mutex);
+        pool.drain();
+        SDL_LockMutex(pool.mutex);
+        if (--pool.busy == 0) SDL_CondSignal(pool.done);
+    }
+    SDL_UnlockMutex(pool.mutex);
+    return 0;
+}
+
+void WorkerPool::drain() {
+    for (size_t i;(i = nextJob.fetch_add(1,std::memory_order_relaxed)) < jobCount;) {
+        try {
+            (*job)(i);
+        } catch (...) {
+            SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+            if (!error) error = std::current_exception();
+        }
+    }
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)> &fn) {
+    // Not worth waking anybody up for
+    if (threads.empty() || count <= 1) {
+        for (size_t i=0;i<count;i++) fn(i);
+        return;
+    }
+    {
+        SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+        job = &fn;
+        jobCount = count;
+        nextJob = 0;
+        busy = threads.size();
+        batch++;
+        SDL_CondBroadcast(wake);
+    }
+    drain();
+    std::exception_ptr failed;
+    {
+        SDL_Lock lock (mutex); // Auto unlocks when it goes out of scope
+        while (busy) SDL_CondWait(done,mutex);
+        job = nullptr;
+        jobCount = 0;
+        std::swap(failed,error);
+    }
+    if (failed) std::rethrow_exception(failed);
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "main.hpp"
+#include <atomic>
+#include <exception>
+#include <functional>
+
+// Runs batches of independent jobs on a fixed set of threads.
+// The calling thread pitches in too, run() returns once the whole batch is done.
+class WorkerPool {
+    private:
+        std::vector<SDL_Thread *> threads;
+        SDL_mutex *mutex;
+        SDL_cond *wake, *done;
+
+        // Current batch, guarded by mutex (except nextJob)
+        const std::function<void(size_t)> *job = nullptr;
+        size_t jobCount = 0;
+        std::atomic<size_t> nextJob = 0;
+        size_t busy = 0; // Workers that haven't finished the batch yet
+        uint64_t batch = 0;
+        bool quit = false;
+        std::exception_ptr error;
+
+        static int run_worker(void *pool);
+        void drain();
+    public:
+        WorkerPool(int threads);
+        ~WorkerPool();
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        // Calls fn(0) to fn(count-1) in parallel, rethrows the first exception any of them threw
+        void run(size_t count, const std::function<void(size_t)> &fn);
+        size_t size() const {return threads.size()+1;};
+};